@@ -0,0 +1,121 @@
+/*
+ *
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+#include "AsyncEnvironment.h"
+
+namespace Neutron
+{
+
+AsyncEnvironment::AsyncEnvironment(Setup setup) : _tail(new Task())
+{
+    _head.store(_tail);
+    std::promise<void> ready;
+    auto started = ready.get_future();
+    _thread = std::thread(&AsyncEnvironment::engineLoop, this, std::move(setup), &ready);
+    try {
+        started.get();
+    } catch (...) {
+        _thread.join();
+        delete _tail;
+        throw;
+    }
+}
+
+AsyncEnvironment::~AsyncEnvironment()
+{
+    _stopping.store(true);
+    {
+        std::lock_guard<std::mutex> guard(_sleepLock);
+        _wakeup.notify_one();
+    }
+    _thread.join();
+    delete _tail;
+}
+
+std::future<int64_t>
+AsyncEnvironment::runAsync(int64_t count)
+{
+    return submit([count](Environment& env) { return env.run(count); });
+}
+
+void
+AsyncEnvironment::enqueue(Task* task)
+{
+    task->next.store(nullptr, std::memory_order_relaxed);
+    auto previous = _head.exchange(task, std::memory_order_acq_rel);
+    // sequentially consistent along with the load of _sleeping, pairs with
+    // the check in engineLoop so either the engine sees this task or we see
+    // that it went to sleep and wake it up
+    previous->next.store(task);
+    if (_sleeping.load()) {
+        std::lock_guard<std::mutex> guard(_sleepLock);
+        _wakeup.notify_one();
+    }
+}
+
+AsyncEnvironment::Task*
+AsyncEnvironment::dequeue()
+{
+    auto next = _tail->next.load(std::memory_order_acquire);
+    if (!next) {
+        return nullptr;
+    }
+    // the old stub has already run, the dequeued task becomes the new stub
+    delete _tail;
+    _tail = next;
+    return next;
+}
+
+void
+AsyncEnvironment::engineLoop(Setup setup, std::promise<void>* ready)
+{
+    std::unique_ptr<Environment> env;
+    try {
+        env.reset(new Environment());
+        if (setup) {
+            setup(*env);
+        }
+    } catch (...) {
+        ready->set_exception(std::current_exception());
+        return;
+    }
+    ready->set_value();
+    while (true) {
+        auto task = dequeue();
+        if (task) {
+            task->run(*env);
+            continue;
+        }
+        if (_stopping.load()) {
+            // producers are gone by now, so an empty queue stays empty
+            break;
+        }
+        std::unique_lock<std::mutex> guard(_sleepLock);
+        _sleeping.store(true);
+        if (!_tail->next.load() && !_stopping.load()) {
+            _wakeup.wait(guard);
+        }
+        _sleeping.store(false);
+    }
+}
+
+} // namespace Neutron
@@ -0,0 +1,160 @@
+/**
+ * @file
+ * An environment which lives on its own thread and is driven through futures
+ * @copyright
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+#ifndef __LibNeutron_AsyncEnvironment_h__
+#define __LibNeutron_AsyncEnvironment_h__
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "Environment.h"
+
+namespace Neutron
+{
+
+/**
+ * Owns an Environment on a dedicated thread. Work is handed to that thread
+ * through a lock free queue and the results come back as futures, so any
+ * number of threads can drive the rule engine without blocking on it and
+ * without ever touching the environment themselves.
+ */
+class AsyncEnvironment
+{
+public:
+    /// Called on the engine thread right after the environment is created,
+    /// usually to load constructs and register functions
+    using Setup = std::function<void(Environment&)>;
+
+    /// @throw anything setup throws
+    explicit AsyncEnvironment(Setup setup = nullptr);
+    AsyncEnvironment(const AsyncEnvironment&) = delete;
+    AsyncEnvironment& operator=(const AsyncEnvironment&) = delete;
+    /// Finishes all of the work submitted so far and then stops the engine thread
+    ~AsyncEnvironment();
+
+    /**
+     * Run the given callable on the engine thread.
+     * @param fn called as fn(Environment&)
+     * @return the future result of fn, exceptions thrown by fn end up in it
+     */
+    template<typename F>
+    std::future<typename EnvironmentCallResult<F>::type> submit(F fn)
+    {
+        using R = typename EnvironmentCallResult<F>::type;
+        auto task = new PackagedTask<R>(std::packaged_task<R(Environment&)>(std::move(fn)));
+        auto result = task->task.get_future();
+        enqueue(task);
+        return result;
+    }
+
+    /// Run the rules of the environment on the engine thread
+    /// @return the future number of rules fired
+    std::future<int64_t> runAsync(int64_t count = -1L);
+
+    /**
+     * Invoke a function on the engine thread. The arguments are copied (or
+     * moved) into the task so they do not have to outlive the call.
+     * @param function the function handle, it must come from the environment
+     * of this object (see submit and Environment::prepareFunction)
+     * @return the future result converted through extractValue
+     */
+    template<typename R, typename ... Args>
+    std::future<R> invokeAsync(const FunctionHandle& function, Args&& ... args)
+    {
+        return submit(makeInvocation<R>(function, std::forward<Args>(args)...));
+    }
+
+    /// Invoke a function by name on the engine thread
+    template<typename R, typename ... Args>
+    std::future<R> invokeAsync(const std::string& function, Args&& ... args)
+    {
+        return submit(makeInvocation<R>(function, std::forward<Args>(args)...));
+    }
+private:
+    /// a queued unit of work, the queue links these together intrusively
+    struct Task
+    {
+        virtual ~Task() = default;
+        virtual void run(Environment&) { }
+        std::atomic<Task*> next{nullptr};
+    };
+
+    template<typename R>
+    struct PackagedTask : Task
+    {
+        explicit PackagedTask(std::packaged_task<R(Environment&)>&& t) : task(std::move(t)) { }
+        void run(Environment& env) override { task(env); }
+        std::packaged_task<R(Environment&)> task;
+    };
+
+    /// calls a function with arguments captured by value, a lambda can not move capture in C++11
+    template<typename R, typename Target, typename Tuple>
+    struct Invocation
+    {
+        R operator()(Environment& env)
+        {
+            return call(env, MakeIndexSequence<std::tuple_size<Tuple>::value>());
+        }
+        template<size_t ... Indices>
+        R call(Environment& env, IndexSequence<Indices...>)
+        {
+            R ret;
+            env.buildAndExecuteFunction(target, ret, std::get<Indices>(args)...);
+            return ret;
+        }
+        Target target;
+        Tuple args;
+    };
+
+    template<typename R, typename Target, typename ... Args>
+    static Invocation<R, Target, std::tuple<typename std::decay<Args>::type...>> makeInvocation(const Target& target, Args&& ... args)
+    {
+        return { target, std::tuple<typename std::decay<Args>::type...>(std::forward<Args>(args)...) };
+    }
+
+    void enqueue(Task* task);
+    /// @return the next task or nullptr when the queue looks empty, only the engine thread may call this
+    Task* dequeue();
+    void engineLoop(Setup setup, std::promise<void>* ready);
+private:
+    /// producers swap themselves in here (Vyukov's intrusive MPSC queue)
+    std::atomic<Task*> _head;
+    /// only touched by the engine thread, always points at the current stub
+    Task* _tail;
+    std::atomic<bool> _sleeping{false};
+    std::atomic<bool> _stopping{false};
+    std::mutex _sleepLock;
+    std::condition_variable _wakeup;
+    std::thread _thread;
+};
+
+} // namespace Neutron
+#endif // end __LibNeutron_AsyncEnvironment_h__
@@ -21,23 +21,263 @@
  */
 
 #include "Environment.h"
+#include <algorithm>
+#include <atomic>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
 extern "C" {
 #include "clips.h"
 }
 
+/// The environment data slot used to store the Neutron bookkeeping, define
+/// this to something else if it collides with other user environment data
+#ifndef NEUTRON_ENVIRONMENT_DATA
+#define NEUTRON_ENVIRONMENT_DATA (USER_ENVIRONMENT_DATA + 7)
+#endif
+
 namespace Neutron
 {
 
+size_t
+allocateTypeId()
+{
+    static std::atomic<size_t> next(0);
+    return next++;
+}
+
+static EnvironmentState**
+getStateSlot(void* theEnv)
+{
+    return static_cast<EnvironmentState**>(GetEnvironmentData(theEnv, NEUTRON_ENVIRONMENT_DATA));
+}
+
+/// invoked by CLIPS when the raw environment is destroyed, the rest of the
+/// environment is already gone at this point so CLIPS must not be touched
+static void
+reclaimEnvironmentState(void* theEnv)
+{
+    auto slot = getStateSlot(theEnv);
+    delete *slot;
+    *slot = nullptr;
+}
+
+/// hand the pooled expression nodes of the given environment back to CLIPS
+static void
+releaseExpressionPool(void* theEnv, EnvironmentState* state)
+{
+    while (state->expressionPool) {
+        auto node = state->expressionPool;
+        state->expressionPool = node->nextArg;
+        node->nextArg = nullptr;
+        ::ReturnExpression(theEnv, node);
+    }
+    state->expressionPoolSize = 0;
+}
+
+/// invoked by CLIPS at the start of destroying the raw environment while it is still usable
+static void
+releaseEnvironmentPools(void* theEnv)
+{
+    releaseExpressionPool(theEnv, *getStateSlot(theEnv));
+}
+
+/// put the given expression and everything hanging off it into the pool
+static void
+poolExpression(void* theEnv, EnvironmentState* state, EXPRESSION* expr)
+{
+    while (expr) {
+        auto next = expr->nextArg;
+        poolExpression(theEnv, state, expr->argList);
+        expr->argList = nullptr;
+        if (state->expressionPoolSize < state->expressionPoolLimit) {
+            expr->nextArg = state->expressionPool;
+            state->expressionPool = expr;
+            ++state->expressionPoolSize;
+        } else {
+            expr->nextArg = nullptr;
+            ::ReturnExpression(theEnv, expr);
+        }
+        expr = next;
+    }
+}
+
+/// invoked by CLIPS after every rule firing while a bounded run is going on
+static void
+checkRunBudget(void* theEnv)
+{
+    auto state = *getStateSlot(theEnv);
+    if (!state->runPredicate || state->runInterrupted) {
+        return;
+    }
+    bool stop = false;
+    try {
+        stop = (*state->runPredicate)();
+    } catch (...) {
+        // exceptions must not unwind through the CLIPS engine
+        state->runFailure = std::current_exception();
+        stop = true;
+    }
+    if (stop) {
+        state->runInterrupted = true;
+        ::EnvHalt(theEnv);
+    }
+}
+
+/// @return the entry for the given construct, nameOf is only asked the first time it is seen
+template<typename F>
+static ProfileEntry&
+findProfileEntry(ProfileTable& table, uint64_t generation, void* key, F nameOf)
+{
+    if (table.generation != generation) {
+        // the constructs the keys point at may have been freed and reused
+        for (auto& entry : table.live) {
+            auto& retired = table.retired[entry.second.name];
+            retired.name = entry.second.name;
+            retired.count += entry.second.count;
+            retired.totalTime += entry.second.totalTime;
+            if (entry.second.maxTime > retired.maxTime) {
+                retired.maxTime = entry.second.maxTime;
+            }
+        }
+        table.live.clear();
+        table.generation = generation;
+    }
+    auto found = table.live.find(key);
+    if (found != table.live.end()) {
+        return found->second;
+    }
+    auto& entry = table.live[key];
+    entry.name = nameOf();
+    return entry;
+}
+
+static void
+recordSample(ProfileEntry& entry, std::chrono::nanoseconds elapsed)
+{
+    ++entry.count;
+    entry.totalTime += elapsed;
+    if (elapsed > entry.maxTime) {
+        entry.maxTime = elapsed;
+    }
+}
+
+/// merge the live and retired entries of the given table by name
+static std::vector<ProfileEntry>
+collectProfile(const ProfileTable& table)
+{
+    auto merged = table.retired;
+    for (auto const& entry : table.live) {
+        auto& target = merged[entry.second.name];
+        target.name = entry.second.name;
+        target.count += entry.second.count;
+        target.totalTime += entry.second.totalTime;
+        if (entry.second.maxTime > target.maxTime) {
+            target.maxTime = entry.second.maxTime;
+        }
+    }
+    std::vector<ProfileEntry> result;
+    result.reserve(merged.size());
+    for (auto& entry : merged) {
+        result.emplace_back(std::move(entry.second));
+    }
+    return result;
+}
+
+/// invoked by CLIPS right before a rule fires while profiling
+static void
+startRuleProfile(void* theEnv, void* activation)
+{
+    auto state = *getStateSlot(theEnv);
+    state->firingRule = static_cast<struct activation*>(activation)->theRule;
+    state->firingStart = std::chrono::steady_clock::now();
+}
+
+/// invoked by CLIPS right after a rule fired while profiling
+static void
+finishRuleProfile(void* theEnv)
+{
+    auto state = *getStateSlot(theEnv);
+    if (!state->firingRule) {
+        return;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - state->firingStart);
+    auto rule = state->firingRule;
+    state->firingRule = nullptr;
+    auto& entry = findProfileEntry(state->ruleProfile, state->generation, rule, [theEnv, rule]() { return std::string(::EnvGetDefruleName(theEnv, rule)); });
+    recordSample(entry, elapsed);
+}
+
+EnvironmentState*
+Environment::attachState(void* theEnv)
+{
+    if (!theEnv) {
+        return nullptr;
+    }
+    auto slot = getStateSlot(theEnv);
+    if (!slot) {
+        if (!::AllocateEnvironmentData(theEnv, NEUTRON_ENVIRONMENT_DATA, sizeof(EnvironmentState*), reclaimEnvironmentState)) {
+            throw Problem("Could not allocate the Neutron environment data!");
+        }
+        slot = getStateSlot(theEnv);
+        *slot = new EnvironmentState();
+        ::EnvAddClearReadyFunction(theEnv, "neutron-release-snapshots", releaseSnapshots, 0);
+        ::EnvAddClearFunction(theEnv, "neutron-invalidate-handles", invalidateConstructs, 0);
+        ::AddEnvironmentCleanupFunction(theEnv, "neutron-release-pools", releaseEnvironmentPools, 0);
+    }
+    return *slot;
+}
+
+/// invoked by CLIPS whenever a (clear) is performed
+void
+Environment::invalidateConstructs(void* theEnv)
+{
+    ++(*getStateSlot(theEnv))->generation;
+    releaseSnapshots(theEnv);
+}
+
+int
+Environment::releaseSnapshots(void* theEnv)
+{
+    auto state = *getStateSlot(theEnv);
+    // release unregisters the snapshot, so work on a copy
+    auto snapshots = state->snapshots;
+    for (auto snapshot : snapshots) {
+        snapshot->release();
+    }
+    return TRUE;
+}
+
 Environment::Environment() : reclaim(true)
 {
     env = CreateEnvironment();
     if (!env) {
         throw Problem("Could not create a CLIPS environment!");
     }
+    state = attachState(env);
 }
 
 
-Environment::Environment(void* theEnv) : reclaim(false), env(theEnv) { }
+Environment::Environment(void* theEnv) : reclaim(false), env(theEnv), state(attachState(theEnv)) { }
+
+Environment::Environment(const BinaryImage& image, const std::function<void(Environment&)>& prepare) : Environment()
+{
+    if (prepare) {
+        prepare(*this);
+    }
+    loadImage(image.path);
+}
 
 Environment::~Environment()
 {
@@ -62,14 +302,48 @@ Environment::funcall(const std::string& functionName, const std::string& args, D
     //
     // So we check if a zero (which is FALSE in clips....) was returned which
     // means that the microcode function was executed successfully.
-    if (::EnvFunctionCall(env, functionName.c_str(), args.c_str(), obj) != 0) {
-        std::stringstream ss;
-        ss << "Function call of (" << functionName << " " << args << ") failed!";
-        auto tmp = ss.str();
-        throw Problem(tmp);
+    auto failed = ::EnvFunctionCall(env, functionName.c_str(), args.c_str(), obj) != 0;
+    noteConstructChange(functionName);
+    if (failed) {
+        throw Problem([functionName, args]() { return describeFuncall(functionName, args); });
+    }
+}
+
+CallError
+Environment::funcall(const std::string& functionName, const std::string& args, DataObjectPtr obj, std::nothrow_t)
+{
+    auto failed = ::EnvFunctionCall(env, functionName.c_str(), args.c_str(), obj) != 0;
+    noteConstructChange(functionName);
+    if (failed) {
+        return CallError::EvaluationFailed;
+    }
+    return CallError::None;
+}
+
+void
+Environment::noteConstructChange(const std::string& functionName)
+{
+    // build and the undef* commands can replace or delete the construct a
+    // handle points at, even when they fail part way through
+    if (functionName == "build" || functionName.compare(0, 5, "undef") == 0) {
+        invalidateConstructs(env);
     }
 }
 
+void
+Environment::invalidateConstructHandles()
+{
+    invalidateConstructs(env);
+}
+
+std::string
+Environment::describeFuncall(const std::string& functionName, const std::string& args)
+{
+    std::stringstream ss;
+    ss << "Function call of (" << functionName << " " << args << ") failed!";
+    return ss.str();
+}
+
 
 
 void
@@ -118,18 +392,194 @@ Environment::reset()
     ::EnvReset(env);
 }
 
+void
+Environment::clear()
+{
+    ::EnvClear(env);
+}
+
 int64_t
 Environment::run(int64_t count)
 {
     return ::EnvRun(env, count);
 }
 
+void
+Environment::enableProfiling(bool enable)
+{
+    static const char* beforeName = "neutron-profile-start";
+    static const char* afterName = "neutron-profile-finish";
+    if (enable == state->profiling) {
+        return;
+    }
+    state->profiling = enable;
+    state->firingRule = nullptr;
+    if (enable) {
+        ::EnvAddBeforeRunFunction(env, beforeName, startRuleProfile, 0);
+        ::EnvAddRunFunction(env, afterName, finishRuleProfile, 0);
+    } else {
+        ::EnvRemoveBeforeRunFunction(env, beforeName);
+        ::EnvRemoveRunFunction(env, afterName);
+    }
+}
+
+bool
+Environment::isProfiling() const
+{
+    return state->profiling;
+}
+
+ProfileSnapshot
+Environment::profile() const
+{
+    ProfileSnapshot snapshot;
+    snapshot.rules = collectProfile(state->ruleProfile);
+    snapshot.functions = collectProfile(state->functionProfile);
+    return snapshot;
+}
+
+void
+Environment::resetProfile()
+{
+    state->ruleProfile = ProfileTable();
+    state->functionProfile = ProfileTable();
+    state->firingRule = nullptr;
+}
+
+void
+Environment::recordInvocation(const FunctionBuilder& builder, std::chrono::nanoseconds elapsed)
+{
+    auto& entry = findProfileEntry(state->functionProfile, state->generation, builder._ref.value, [&builder]() { return builder.getFunctionName(); });
+    recordSample(entry, elapsed);
+}
+
+void
+Environment::recordInvocation(void* function, const char* name, std::chrono::nanoseconds elapsed)
+{
+    auto& entry = findProfileEntry(state->functionProfile, state->generation, function, [name]() { return std::string(name); });
+    recordSample(entry, elapsed);
+}
+
+/// count the entries of a CLIPS hash table and how many of them are ephemeral
+template<typename Node>
+static void
+countAtoms(Node** table, size_t buckets, size_t& total, size_t& ephemeral)
+{
+    if (!table) {
+        return;
+    }
+    for (size_t i = 0; i < buckets; ++i) {
+        for (auto node = table[i]; node; node = node->next) {
+            ++total;
+            if (node->markedEphemeral) {
+                ++ephemeral;
+            }
+        }
+    }
+}
+
+MemoryStatistics
+Environment::memoryStats() const
+{
+    MemoryStatistics stats;
+    stats.bytesInUse = ::EnvMemUsed(env);
+    stats.outstandingRequests = ::EnvMemRequests(env);
+    countAtoms(::GetSymbolTable(env), SYMBOL_HASH_SIZE, stats.symbols, stats.ephemeralSymbols);
+    size_t numbers = 0;
+    countAtoms(::GetFloatTable(env), FLOAT_HASH_SIZE, numbers, stats.ephemeralNumbers);
+    countAtoms(::GetIntegerTable(env), INTEGER_HASH_SIZE, numbers, stats.ephemeralNumbers);
+    return stats;
+}
+
+int64_t
+Environment::compact()
+{
+    trimExpressionPool();
+    // clean up every evaluation depth and do not let the heuristics skip it
+    ::PeriodicCleanup(env, TRUE, FALSE);
+    return ::EnvReleaseMem(env, -1);
+}
+
+int64_t
+Environment::releaseMemory(int64_t threshold)
+{
+    if (::EnvMemUsed(env) <= threshold) {
+        return 0;
+    }
+    return compact();
+}
+
+RunResult
+Environment::runFor(std::chrono::nanoseconds budget, int64_t count)
+{
+    auto deadline = std::chrono::steady_clock::now() + budget;
+    return runUntil([deadline]() { return std::chrono::steady_clock::now() >= deadline; }, count);
+}
+
+/// @return true if the given module has an activation on its agenda
+static bool
+moduleHasActivations(void* theEnv, void* module)
+{
+    auto current = ::EnvGetCurrentModule(theEnv);
+    ::EnvSetCurrentModule(theEnv, module);
+    auto result = ::EnvGetNextActivation(theEnv, nullptr) != nullptr;
+    ::EnvSetCurrentModule(theEnv, current);
+    return result;
+}
+
+/// @return true if another run would still fire a rule: some module on the
+/// focus stack has activations, or the stack is empty and MAIN (which a run
+/// focuses on in that case) has
+static bool
+agendaHasActivations(void* theEnv)
+{
+    auto theFocus = static_cast<struct focus*>(::EnvGetNextFocus(theEnv, nullptr));
+    if (!theFocus) {
+        return moduleHasActivations(theEnv, ::EnvFindDefmodule(theEnv, "MAIN"));
+    }
+    for (; theFocus; theFocus = static_cast<struct focus*>(::EnvGetNextFocus(theEnv, theFocus))) {
+        if (moduleHasActivations(theEnv, theFocus->theModule)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+RunResult
+Environment::runUntil(const std::function<bool()>& stop, int64_t count)
+{
+    static const char* hookName = "neutron-run-budget";
+    if (state->runPredicate) {
+        throw Problem("Bounded runs of the same environment can not be nested!");
+    }
+    state->runPredicate = &stop;
+    state->runInterrupted = false;
+    state->runFailure = nullptr;
+    ::EnvAddRunFunction(env, hookName, checkRunBudget, 0);
+    RunResult result;
+    result.rulesFired = ::EnvRun(env, count);
+    ::EnvRemoveRunFunction(env, hookName);
+    state->runPredicate = nullptr;
+    result.budgetExpired = state->runInterrupted;
+    // the current module's agenda says nothing about the other modules on the focus stack
+    result.agendaDrained = !agendaHasActivations(env);
+    if (state->runFailure) {
+        auto failure = state->runFailure;
+        state->runFailure = nullptr;
+        std::rethrow_exception(failure);
+    }
+    return result;
+}
+
 
 void
 Environment::loadFile(const std::string& path)
 {
     std::stringstream st;
-    switch (::EnvLoad(env, path.c_str())) {
+    auto result = ::EnvLoad(env, path.c_str());
+    // constructs parsed before an error are already in place and may have replaced older ones
+    invalidateConstructs(env);
+    switch (result) {
     case -1: // parse error
         st << "Unable to parse file: " << path;
         throw Problem(st.str());
@@ -143,6 +593,160 @@ Environment::loadFile(const std::string& path)
     }
 }
 
+void
+Environment::loadFromBuffer(const char* data, size_t len, const std::string& name)
+{
+    static const char* logicalName = "neutron-load-buffer";
+    if (::OpenTextSource(env, logicalName, data, 0, len) == FALSE) {
+        std::stringstream st;
+        st << "Unable to open " << name << " for parsing";
+        auto str = st.str();
+        throw Problem(str);
+    }
+    // the same bookkeeping EnvLoad does around parsing a file, so errors name
+    // the buffer and constructs can tell that a load is in progress
+    auto oldParsingFileName = ::CopyString(env, ::EnvGetParsingFileName(env));
+    ::SetParsingFileName(env, name.c_str());
+    ::SetLoadInProgress(env, TRUE);
+    auto noErrors = ::LoadConstructsFromLogicalName(env, logicalName);
+    ::SetLoadInProgress(env, FALSE);
+    ::SetParsingFileName(env, oldParsingFileName);
+    ::DeleteString(env, oldParsingFileName);
+    ::SetWarningFileName(env, nullptr);
+    ::SetErrorFileName(env, nullptr);
+    ::CloseStringSource(env, logicalName);
+    invalidateConstructs(env);
+    if (!noErrors) {
+        std::stringstream st;
+        st << "Unable to parse " << name;
+        auto str = st.str();
+        throw Problem(str);
+    }
+}
+
+#ifndef _WIN32
+void
+Environment::loadMappedFile(const std::string& path)
+{
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        std::stringstream st;
+        st << "Unable to load file: " << path;
+        auto str = st.str();
+        throw Problem(str);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) == -1) {
+        ::close(fd);
+        std::stringstream st;
+        st << "Unable to load file: " << path;
+        auto str = st.str();
+        throw Problem(str);
+    }
+    size_t len = static_cast<size_t>(info.st_size);
+    if (len == 0) {
+        // nothing to map, but an empty file is still a successful load
+        ::close(fd);
+        invalidateConstructs(env);
+        return;
+    }
+    auto data = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        std::stringstream st;
+        st << "Unable to map file: " << path;
+        auto str = st.str();
+        throw Problem(str);
+    }
+    ::madvise(data, len, MADV_SEQUENTIAL);
+    try {
+        loadFromBuffer(static_cast<const char*>(data), len, path);
+    } catch (...) {
+        ::munmap(data, len);
+        throw;
+    }
+    ::munmap(data, len);
+}
+#else
+void
+Environment::loadMappedFile(const std::string& path)
+{
+    auto file = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        std::stringstream st;
+        st << "Unable to load file: " << path;
+        auto str = st.str();
+        throw Problem(str);
+    }
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(file, &size)) {
+        ::CloseHandle(file);
+        std::stringstream st;
+        st << "Unable to load file: " << path;
+        auto str = st.str();
+        throw Problem(str);
+    }
+    size_t len = static_cast<size_t>(size.QuadPart);
+    if (len == 0) {
+        // CreateFileMapping refuses empty files, but an empty file is still a successful load
+        ::CloseHandle(file);
+        invalidateConstructs(env);
+        return;
+    }
+    auto mapping = ::CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    // the mapping keeps the file open on its own
+    ::CloseHandle(file);
+    if (!mapping) {
+        std::stringstream st;
+        st << "Unable to map file: " << path;
+        auto str = st.str();
+        throw Problem(str);
+    }
+    auto data = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    // as does the view with the mapping
+    ::CloseHandle(mapping);
+    if (!data) {
+        std::stringstream st;
+        st << "Unable to map file: " << path;
+        auto str = st.str();
+        throw Problem(str);
+    }
+    try {
+        loadFromBuffer(static_cast<const char*>(data), len, path);
+    } catch (...) {
+        ::UnmapViewOfFile(data);
+        throw;
+    }
+    ::UnmapViewOfFile(data);
+}
+#endif
+
+void
+Environment::saveImage(const std::string& path)
+{
+    if (::EnvBsave(env, path.c_str()) == FALSE) {
+        std::stringstream st;
+        st << "Unable to save binary image: " << path;
+        auto str = st.str();
+        throw Problem(str);
+    }
+}
+
+void
+Environment::loadImage(const std::string& path)
+{
+    auto result = ::EnvBload(env, path.c_str());
+    // the old constructs are gone even if the load failed part way through
+    invalidateConstructs(env);
+    if (result == FALSE) {
+        std::stringstream st;
+        st << "Unable to load binary image: " << path;
+        auto str = st.str();
+        throw Problem(str);
+    }
+}
+
 void*
 Environment::getRawEnvironment()
 {
@@ -153,10 +757,11 @@ void
 Environment::watch(const std::string& value)
 {
     if (::EnvWatch(env, value.c_str()) == 0) {
-        std::stringstream ss;
-        ss << "Attempting to watch '" << value << "' was not successful!";
-        auto str = ss.str();
-        throw Problem(str);
+        throw Problem([value]() {
+            std::stringstream ss;
+            ss << "Attempting to watch '" << value << "' was not successful!";
+            return ss.str();
+        });
     }
 }
 
@@ -164,25 +769,131 @@ void
 Environment::unwatch(const std::string& value)
 {
     if (::EnvUnwatch(env, value.c_str()) == 0) {
-        std::stringstream ss;
-        ss << "Attempting to unwatch '" << value << "' was not successful!";
-        auto str = ss.str();
-        throw Problem(str);
+        throw Problem([value]() {
+            std::stringstream ss;
+            ss << "Attempting to unwatch '" << value << "' was not successful!";
+            return ss.str();
+        });
+    }
+}
+
+size_t
+SymbolCacheKeyHash::operator()(const SymbolCacheKey& key) const
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.length; ++i) {
+        hash ^= static_cast<unsigned char>(key.data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash);
+}
+
+void*
+Environment::addCachedSymbol(const char* symbol, size_t length)
+{
+    auto found = state->symbolCache.find(SymbolCacheKey { symbol, length });
+    if (found != state->symbolCache.end()) {
+        ++state->symbolCacheHits;
+        return found->second;
+    }
+    ++state->symbolCacheMisses;
+    void* result = (void*)::EnvAddSymbol(env, symbol);
+    if (state->symbolCache.size() < state->symbolCacheLimit) {
+        // key on the symbol's own contents, they outlive the entry because of the reference taken below
+        const char* contents = ValueToString(result);
+        if (state->symbolCache.emplace(SymbolCacheKey { contents, std::strlen(contents) }, result).second) {
+            IncrementSymbolCount(result);
+        }
     }
+    return result;
 }
 
 void*
 Environment::addSymbol(const std::string& symbol)
 {
+    if (state->symbolCacheEnabled) {
+        return addCachedSymbol(symbol.c_str(), symbol.size());
+    }
     return (void*)::EnvAddSymbol(env, symbol.c_str());
 }
 
 void*
 Environment::addSymbol(const char* symbol)
 {
+    if (state->symbolCacheEnabled) {
+        return addCachedSymbol(symbol, std::strlen(symbol));
+    }
     return (void*)::EnvAddSymbol(env, symbol);
 }
 
+void*
+Environment::addSymbol(SymbolId symbol)
+{
+    if (symbol.index >= state->registeredSymbols.size()) {
+        std::stringstream ss;
+        ss << "symbol id " << symbol.index << " was not registered with this environment (" << state->registeredSymbols.size() << " registered)";
+        throw Problem(ss.str());
+    }
+    return state->registeredSymbols[symbol.index];
+}
+
+SymbolId
+Environment::registerSymbol(const std::string& symbol)
+{
+    void* result = (void*)::EnvAddSymbol(env, symbol.c_str());
+    IncrementSymbolCount(result);
+    state->registeredSymbols.emplace_back(result);
+    return SymbolId { state->registeredSymbols.size() - 1 };
+}
+
+void
+Environment::enableSymbolCache(bool enable, size_t maximumEntries)
+{
+    state->symbolCacheEnabled = enable;
+    state->symbolCacheLimit = maximumEntries;
+    if (!enable) {
+        clearSymbolCache();
+    }
+}
+
+void
+Environment::clearSymbolCache()
+{
+    for (auto const& entry : state->symbolCache) {
+        ::DecrementSymbolCount(env, static_cast<SYMBOL_HN*>(entry.second));
+    }
+    state->symbolCache.clear();
+}
+
+SymbolCacheStatistics
+Environment::getSymbolCacheStatistics() const
+{
+    return SymbolCacheStatistics { state->symbolCacheHits, state->symbolCacheMisses, state->symbolCache.size(), state->registeredSymbols.size() };
+}
+
+void
+Environment::enableExpressionPool(bool enable, size_t maximumNodes)
+{
+    state->expressionPoolEnabled = enable;
+    state->expressionPoolLimit = maximumNodes;
+    if (!enable) {
+        trimExpressionPool();
+    }
+}
+
+void
+Environment::trimExpressionPool()
+{
+    releaseExpressionPool(env, state);
+}
+
+ExpressionPoolStatistics
+Environment::getExpressionPoolStatistics() const
+{
+    return ExpressionPoolStatistics { state->expressionsRecycled, state->expressionsAllocated, state->expressionPoolSize };
+}
+
 void*
 Environment::addNumber(int32_t number)
 {
@@ -232,17 +943,189 @@ Environment::setSlot(void* instance, const std::string& slotName, DataObjectPtr
 {
     if (::EnvDirectPutSlot(env, instance, slotName.c_str(), value) == 0) {
         /// @todo add support for printing out the data object value
+        throw Problem([slotName]() {
+            std::stringstream msg;
+            msg << "Attempting to set slot '" << slotName << "' failed!";
+            return msg.str();
+        });
+    }
+}
+
+void
+Environment::getSlot(void* instance, const std::string& slotName, DataObjectPtr ret)
+{
+    ::EnvDirectGetSlot(env, instance, slotName.c_str(), ret);
+}
+
+DefclassHandle
+Environment::findDefclass(const std::string& name)
+{
+    auto defclass = ::EnvFindDefclass(env, name.c_str());
+    if (!defclass) {
+        std::stringstream ss;
+        ss << "Defclass " << name << " does not exist!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    return DefclassHandle(this, name, defclass, state->generation);
+}
+
+SlotHandle
+Environment::findSlot(const DefclassHandle& defclass, const std::string& slotName)
+{
+    defclass.ensureValid(this);
+    auto theSlotName = addSymbol(slotName);
+    auto index = ::FindInstanceTemplateSlot(env, static_cast<DEFCLASS*>(defclass.getRawDefclass()), static_cast<SYMBOL_HN*>(theSlotName));
+    if (index < 0) {
+        std::stringstream ss;
+        ss << "Defclass " << defclass.getName() << " does not have a slot named " << slotName << "!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    return SlotHandle(this, slotName, defclass.getRawDefclass(), theSlotName, index, state->generation);
+}
+
+void*
+Environment::resolveSlot(void* instance, const SlotHandle& slot)
+{
+    slot.ensureValid(this);
+    auto ins = static_cast<INSTANCE_TYPE*>(instance);
+    if (ins->garbage) {
+        std::stringstream msg;
+        msg << "Attempted to access slot '" << slot.getName() << "' of a deleted instance!";
+        auto tmp = msg.str();
+        throw Problem(tmp);
+    }
+    INSTANCE_SLOT* sp = nullptr;
+    if (ins->cls == slot._defclass) {
+        sp = ins->slotAddresses[slot._index];
+    } else {
+        sp = ::FindInstanceSlot(env, ins, static_cast<SYMBOL_HN*>(slot._slotName));
+    }
+    if (!sp) {
         std::stringstream msg;
-        msg << "Attempting to set slot '" << slotName << "' failed!";
+        msg << "Instance does not have a slot named '" << slot.getName() << "'!";
         auto tmp = msg.str();
         throw Problem(tmp);
     }
+    return sp;
 }
 
 void
-Environment::getSlot(void* instance, const std::string& slotName, DataObjectPtr ret)
+Environment::setSlot(void* instance, const SlotHandle& slot, DataObjectPtr value)
 {
-    ::EnvDirectGetSlot(env, instance, slotName.c_str(), ret);
+    auto sp = static_cast<INSTANCE_SLOT*>(resolveSlot(instance, slot));
+    DataObject junk;
+    if (::PutSlotValue(env, static_cast<INSTANCE_TYPE*>(instance), sp, value, &junk, "external put") == FALSE) {
+        std::stringstream msg;
+        msg << "Attempting to set slot '" << slot.getName() << "' failed!";
+        auto tmp = msg.str();
+        throw Problem(tmp);
+    }
+}
+
+void
+Environment::getSlot(void* instance, const SlotHandle& slot, DataObjectPtr ret)
+{
+    // mirrors EnvDirectGetSlot minus the slot name lookup
+    auto sp = static_cast<INSTANCE_SLOT*>(resolveSlot(instance, slot));
+    SetpType(ret, sp->type);
+    SetpValue(ret, sp->value);
+    if (sp->type == MULTIFIELD) {
+        SetpDOBegin(ret, 1);
+        SetpDOEnd(ret, GetMFLength(sp->value));
+    }
+    ::PropagateReturnValue(env, ret);
+}
+
+void
+Environment::getSlots(void* instance, const std::vector<SlotHandle>& slots, DataObjectPtr ret)
+{
+    for (auto const& slot : slots) {
+        getSlot(instance, slot, ret);
+        ++ret;
+    }
+}
+
+void
+Environment::getFactSlot(void* fact, const FactSlotHandle& slot, DataObjectPtr ret)
+{
+    slot.ensureValid(this);
+    auto theFact = static_cast<struct fact*>(fact);
+    if (theFact->whichDeftemplate != slot._deftemplate) {
+        std::stringstream ss;
+        ss << "Slot handle for " << slot.getName() << " does not belong to the deftemplate of the given fact!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    auto& theField = theFact->theProposition.theFields[slot._position - 1];
+    SetpType(ret, theField.type);
+    SetpValue(ret, theField.value);
+    if (theField.type == MULTIFIELD) {
+        SetpDOBegin(ret, 1);
+        SetpDOEnd(ret, GetMFLength(theField.value));
+    }
+}
+
+void
+Environment::retractFact(void* fact)
+{
+    if (::EnvRetract(env, fact) == FALSE) {
+        throw Problem("Could not retract the fact!");
+    }
+}
+
+void
+Environment::retainFact(void* fact)
+{
+    ::EnvIncrementFactCount(env, fact);
+}
+
+void
+Environment::releaseFact(void* fact)
+{
+    ::EnvDecrementFactCount(env, fact);
+}
+
+bool
+Environment::factExists(void* fact)
+{
+    return ::EnvFactExistp(env, fact) != FALSE;
+}
+
+FactQuery
+Environment::facts(const DeftemplateHandle& deftemplate)
+{
+    deftemplate.ensureValid(this);
+    return FactQuery(this, { deftemplate.getRawDeftemplate() });
+}
+
+/// collect the given class and, once each, every class which inherits from it
+static void
+collectSubclasses(DEFCLASS* cls, std::vector<void*>& out)
+{
+    for (auto const& seen : out) {
+        if (seen == cls) {
+            return;
+        }
+    }
+    out.emplace_back(cls);
+    for (long i = 0; i < cls->directSubclasses.classCount; ++i) {
+        collectSubclasses(cls->directSubclasses.classArray[i], out);
+    }
+}
+
+InstanceQuery
+Environment::instances(const DefclassHandle& defclass, bool includeSubclasses)
+{
+    defclass.ensureValid(this);
+    std::vector<void*> classes;
+    if (includeSubclasses) {
+        collectSubclasses(static_cast<DEFCLASS*>(defclass.getRawDefclass()), classes);
+    } else {
+        classes.emplace_back(defclass.getRawDefclass());
+    }
+    return InstanceQuery(this, std::move(classes));
 }
 
 void
@@ -257,6 +1140,18 @@ Environment::deinstallExpression(EXPRESSION* expr)
     ::ExpressionDeinstall(env, expr);
 }
 
+void
+Environment::installAtom(uint16_t type, void* value)
+{
+    ::AtomInstall(env, type, value);
+}
+
+void
+Environment::deinstallAtom(uint16_t type, void* value)
+{
+    ::AtomDeinstall(env, type, value);
+}
+
 bool
 Environment::evaluateExpression(EXPRESSION* expr, DataObjectPtr ret)
 {
@@ -264,16 +1159,42 @@ Environment::evaluateExpression(EXPRESSION* expr, DataObjectPtr ret)
     return ::EvaluateExpression(env, expr, ret) != TRUE;
 }
 
+void
+Environment::clearEvaluationError()
+{
+    ::SetEvaluationError(env, FALSE);
+    ::SetHaltExecution(env, FALSE);
+}
+
 void
 Environment::reclaimExpressionList(EXPRESSION* expr)
 {
-    ::ReturnExpression(env, expr);
+    if (!state->expressionPoolEnabled) {
+        ::ReturnExpression(env, expr);
+        return;
+    }
+    poolExpression(env, state, expr);
 }
 
 EXPRESSION*
 Environment::generateConstantExpression(uint16_t type, void* value)
 {
-    return ::GenConstant(env, type, value);
+    if (!state->expressionPoolEnabled) {
+        return ::GenConstant(env, type, value);
+    }
+    auto expr = state->expressionPool;
+    if (!expr) {
+        ++state->expressionsAllocated;
+        return ::GenConstant(env, type, value);
+    }
+    ++state->expressionsRecycled;
+    state->expressionPool = expr->nextArg;
+    --state->expressionPoolSize;
+    expr->type = type;
+    expr->value = value;
+    expr->argList = nullptr;
+    expr->nextArg = nullptr;
+    return expr;
 }
 
 bool
@@ -282,90 +1203,829 @@ Environment::generateFunctionExpression(const std::string& name, FUNCTION_REFERE
     return ::GetFunctionReference(env, name.c_str(), ref) == TRUE;
 }
 
-void
-Environment::extractValue(DataObjectPtr dobj, std::function<void(Environment*, DataObjectPtr)> fn)
+FunctionHandle
+Environment::prepareFunction(const std::string& name)
+{
+    FUNCTION_REFERENCE ref;
+    if (!generateFunctionExpression(name, &ref)) {
+        std::stringstream ss;
+        ss << "Function " << name << " does not exist!!!!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    return FunctionHandle(this, name, ref, state->generation);
+}
+
+FUNCTION_REFERENCE
+Environment::resolveBoundFunction(size_t id, const char* name)
+{
+    auto& bound = state->boundFunctions;
+    if (bound.size() <= id) {
+        bound.resize(id + 1);
+    }
+    auto& entry = bound[id];
+    if (!entry.resolved || entry.generation != state->generation) {
+        entry.resolved = false;
+        if (!generateFunctionExpression(name, &entry.ref)) {
+            throw Problem([name]() {
+                std::stringstream ss;
+                ss << "Function " << name << " does not exist!!!!";
+                return ss.str();
+            });
+        }
+        entry.generation = state->generation;
+        entry.resolved = true;
+    }
+    return entry.ref;
+}
+
+void
+Environment::invokeBoundFunction(FUNCTION_REFERENCE* call, const char* name, DataObjectPtr ret)
+{
+    for (auto arg = call->argList; arg; arg = arg->nextArg) {
+        installAtom(arg->type, arg->value);
+    }
+    bool success;
+    if (!state->profiling) {
+        success = evaluateExpression(call, ret);
+    } else {
+        auto start = std::chrono::steady_clock::now();
+        success = evaluateExpression(call, ret);
+        recordInvocation(call->value, name, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start));
+    }
+    for (auto arg = call->argList; arg; arg = arg->nextArg) {
+        deinstallAtom(arg->type, arg->value);
+    }
+    if (!success) {
+        throw Problem([name]() {
+            std::stringstream ss;
+            ss << "ERROR: invocation of (" << name << " ...) yielded an error!";
+            return ss.str();
+        });
+    }
+}
+
+uint64_t
+Environment::getConstructGeneration() const
+{
+    return state->generation;
+}
+
+DeftemplateHandle
+Environment::findDeftemplate(const std::string& name)
+{
+    auto deftemplate = ::EnvFindDeftemplate(env, name.c_str());
+    if (!deftemplate) {
+        std::stringstream ss;
+        ss << "Deftemplate " << name << " does not exist!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    return DeftemplateHandle(this, name, deftemplate, state->generation);
+}
+
+FactSlotHandle
+Environment::findFactSlot(const DeftemplateHandle& deftemplate, const std::string& slotName)
+{
+    deftemplate.ensureValid(this);
+    auto theDeftemplate = static_cast<struct deftemplate*>(deftemplate.getRawDeftemplate());
+    if (theDeftemplate->implied) {
+        std::stringstream ss;
+        ss << "Cannot resolve slot " << slotName << " of ordered deftemplate " << deftemplate.getName() << "!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    short position = 0;
+    auto theSlot = ::FindSlot(theDeftemplate, static_cast<SYMBOL_HN*>(addSymbol(slotName)), &position);
+    if (!theSlot) {
+        std::stringstream ss;
+        ss << "Deftemplate " << deftemplate.getName() << " does not have a slot named " << slotName << "!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    return FactSlotHandle(this, slotName, theDeftemplate, position, theSlot->multislot, state->generation);
+}
+
+void
+Environment::extractValue(DataObjectPtr dobj, std::function<void(Environment*, DataObjectPtr)> fn)
+{
+    fn(this, dobj);
+}
+
+
+void
+Environment::unmakeInstance(void* instancePtr)
+{
+    ::EnvUnmakeInstance(env, instancePtr);
+}
+
+void
+Environment::buildAndExecuteFunction(const std::string& function)
+{
+    DataObject dontCare;
+    buildAndExecuteFunction(function, &dontCare);
+}
+
+void
+Environment::buildAndExecuteFunction(const std::string& function, DataObjectPtr ret)
+{
+    FunctionBuilder fb(this);
+    fb.setFunctionReference(function);
+    fb.invoke(ret);
+}
+
+void
+Environment::buildAndExecuteFunction(const FunctionHandle& function)
+{
+    DataObject dontCare;
+    buildAndExecuteFunction(function, &dontCare);
+}
+
+void
+Environment::buildAndExecuteFunction(const FunctionHandle& function, DataObjectPtr ret)
+{
+    FunctionBuilder fb(this);
+    fb.setFunctionReference(function);
+    fb.invoke(ret);
+}
+
+int
+Environment::installExternalAddressType(Environment::ExternalAddressType* description)
+{
+    return ::InstallExternalAddressType(env, description);
+}
+
+bool
+Environment::checkArgument(const std::string& function, int position, int type, DataObjectPtr ptr)
+{
+    return EnvArgTypeCheck(env, function.c_str(), position, type, ptr) != FALSE;
+}
+
+bool
+Environment::checkArgument(const std::string& function, int position, DataObjectType type, DataObjectPtr ptr)
+{
+    return checkArgument(function, position, static_cast<int>(type), ptr);
+}
+
+bool
+Environment::argumentIsExternalAddress(const std::string& function, int position, DataObjectPtr ptr)
+{
+    return checkArgument(function, position, EXTERNAL_ADDRESS, ptr);
+}
+
+bool
+Environment::installUserFunction(const std::string& name, int returnType, Environment::RawFunction body, const std::string& actualName, const char* restrictions)
+{
+    return ::EnvDefineFunction2(env, name.c_str(), returnType, body, actualName.c_str(), restrictions);
+}
+
+bool
+Environment::installUserFunction(const std::string& name, UserFunctionReturnType returnType, Environment::RawFunction body, const std::string& actualName, const char* restrictions)
+{
+   return installUserFunction(name, static_cast<int>(returnType), body, actualName, restrictions);
+}
+
+bool
+Environment::defineBoundFunction(std::unique_ptr<UserFunctionBinding> binding, int returnType, Environment::RawFunction body, const char* restrictions)
+{
+    auto name = binding->name.c_str();
+    if (::EnvDefineFunction2WithContext(env, name, returnType, body, name, restrictions, binding.get()) == FALSE) {
+        return false;
+    }
+    // CLIPS refers to the binding and its name from now on
+    state->userFunctions.emplace_back(std::move(binding));
+    return true;
+}
+
+void
+reportUserFunctionFailure(void* theEnv, const std::string& function, const char* what)
+{
+    ::PrintErrorID(theEnv, "NEUTRON", 1, FALSE);
+    ::EnvPrintRouter(theEnv, WERROR, "Function ");
+    ::EnvPrintRouter(theEnv, WERROR, function.c_str());
+    ::EnvPrintRouter(theEnv, WERROR, " failed: ");
+    ::EnvPrintRouter(theEnv, WERROR, what);
+    ::EnvPrintRouter(theEnv, WERROR, "\n");
+    ::SetEvaluationError(theEnv, TRUE);
+}
+
+void*
+Environment::createMultifield(int32_t size)
+{
+    return ::EnvCreateMultifield(env, size);
+}
+
+int
+Environment::getArgumentCount() const
+{
+    return ::EnvRtnArgCount(env);
+}
+
+// End Environment stuff
+
+// Begin handle stuff
+ConstructHandle::ConstructHandle(Environment* env, const std::string& name, uint64_t generation) : _rawEnv(env->getRawEnvironment()), _state(*getStateSlot(_rawEnv)), _name(name), _generation(generation) { }
+
+bool
+ConstructHandle::isValid() const
+{
+    return _state && _state->generation == _generation;
+}
+
+void
+ConstructHandle::ensureValid() const
+{
+    if (!isValid()) {
+        std::stringstream ss;
+        ss << "Handle for " << _name << " is stale and must be looked up again!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+}
+
+void
+ConstructHandle::ensureValid(Environment* env) const
+{
+    ensureValid();
+    if (_rawEnv != env->getRawEnvironment()) {
+        std::stringstream ss;
+        ss << "Handle for " << _name << " belongs to a different environment!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+}
+
+FunctionHandle::FunctionHandle(Environment* env, const std::string& name, const FUNCTION_REFERENCE& ref, uint64_t generation) : ConstructHandle(env, name, generation), _ref(ref) { }
+// end handle stuff
+
+// Begin FactBuilder stuff
+FactBuilder::FactBuilder(Environment* env, const DeftemplateHandle& deftemplate) : _env(env), _deftemplate(deftemplate.getRawDeftemplate())
+{
+    deftemplate.ensureValid(env);
+}
+
+FactBuilder::~FactBuilder()
+{
+    if (_fact) {
+        ::ReturnFact(_env->getRawEnvironment(), static_cast<struct fact*>(_fact));
+        _fact = nullptr;
+    }
+}
+
+void*
+FactBuilder::getFact()
+{
+    if (!_fact) {
+        _fact = ::EnvCreateFact(_env->getRawEnvironment(), _deftemplate);
+        if (!_fact) {
+            throw Problem("Could not create a new fact!");
+        }
+    }
+    return _fact;
+}
+
+FactBuilder&
+FactBuilder::set(const FactSlotHandle& slot, DataObjectPtr value)
+{
+    slot.ensureValid(_env);
+    if (slot._deftemplate != _deftemplate) {
+        std::stringstream ss;
+        ss << "Slot handle for " << slot.getName() << " does not belong to the deftemplate of this fact builder!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    bool isMultifield = GetpType(value) == MULTIFIELD;
+    if (isMultifield != slot._multislot) {
+        std::stringstream ss;
+        ss << "Attempted to store a " << (isMultifield ? "multifield" : "single field") << " value in slot " << slot.getName() << "!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    auto theEnv = _env->getRawEnvironment();
+    auto& theField = static_cast<struct fact*>(getFact())->theProposition.theFields[slot._position - 1];
+    if (theField.type == MULTIFIELD) {
+        // the previous multifield was copied by us and is not referenced by anything else
+        ::ReturnMultifield(theEnv, static_cast<struct multifield*>(theField.value));
+    }
+    theField.type = GetpType(value);
+    theField.value = isMultifield ? ::DOToMultifield(theEnv, value) : GetpValue(value);
+    return *this;
+}
+
+void*
+FactBuilder::assertFact()
+{
+    auto theEnv = _env->getRawEnvironment();
+    auto theFact = getFact();
+    if (::EnvAssignFactSlotDefaults(theEnv, theFact) == FALSE) {
+        // a (default ?NONE) slot was not set, start over on a fresh fact
+        ::ReturnFact(theEnv, static_cast<struct fact*>(theFact));
+        _fact = nullptr;
+        throw Problem("Could not assert the fact, a slot without a default value was not set!");
+    }
+    // CLIPS owns the fact from here on out, even if the assertion fails
+    _fact = nullptr;
+    auto result = ::EnvAssert(theEnv, theFact);
+    if (!result) {
+        throw Problem("Could not assert the fact!");
+    }
+    return result;
+}
+// end FactBuilder stuff
+
+// Begin Query stuff
+void*
+QuerySource<FactSlotHandle>::next(Environment* env, void* deftemplate, void* current)
+{
+    return ::EnvGetNextFactInTemplate(env->getRawEnvironment(), deftemplate, current);
+}
+
+void
+QuerySource<FactSlotHandle>::project(Environment* env, void* fact, const FactSlotHandle& slot, DataObjectPtr ret)
+{
+    env->getFactSlot(fact, slot, ret);
+}
+
+void*
+QuerySource<SlotHandle>::next(Environment* env, void* defclass, void* current)
+{
+    return ::EnvGetNextInstanceInClass(env->getRawEnvironment(), defclass, current);
+}
+
+void
+QuerySource<SlotHandle>::project(Environment* env, void* instance, const SlotHandle& slot, DataObjectPtr ret)
+{
+    env->getSlot(instance, slot, ret);
+}
+// end Query stuff
+
+// Begin InstanceBuilder stuff
+InstanceBuilder::InstanceBuilder(Environment* env, const DefclassHandle& defclass) : _env(env), _defclass(defclass.getRawDefclass()), _className(defclass.getName())
+{
+    defclass.ensureValid(env);
+    if (!_env->generateFunctionExpression("make-instance", &_ref) ||
+        !_env->generateFunctionExpression("gensym*", &_gensym)) {
+        throw Problem("make-instance is not available in this environment!");
+    }
+    _ref.nextArg = nullptr;
+    _gensym.nextArg = nullptr;
+    // the name starts out as the gensym* call, which has nothing to install
+    auto name = _env->generateConstantExpression(_gensym.type, _gensym.value);
+    auto cls = _env->generateConstantExpression(SYMBOL, _env->addSymbol(_className));
+    _env->installExpression(cls);
+    name->nextArg = cls;
+    _ref.argList = name;
+}
+
+InstanceBuilder::~InstanceBuilder()
+{
+    _env->deinstallExpression(_ref.argList);
+    _env->reclaimExpressionList(_ref.argList);
+    _ref.argList = nullptr;
+    _lastOverride = nullptr;
+}
+
+InstanceBuilder&
+InstanceBuilder::setName(const std::string& name)
+{
+    auto theName = _ref.argList;
+    auto value = _env->addSymbol(name);
+    _env->installAtom(SYMBOL, value);
+    _env->deinstallAtom(theName->type, theName->value);
+    theName->type = SYMBOL;
+    theName->value = value;
+    return *this;
+}
+
+InstanceBuilder&
+InstanceBuilder::set(const SlotHandle& slot, DataObjectPtr value)
+{
+    slot.ensureValid(_env);
+    if (slot._defclass != _defclass) {
+        std::stringstream ss;
+        ss << "Slot handle for " << slot.getName() << " does not belong to the defclass of this instance builder!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    auto theEnv = _env->getRawEnvironment();
+    // same layout the make-instance parser produces: the slot name followed
+    // by a placeholder whose arguments are the values of the slot
+    auto slotName = _env->generateConstantExpression(SYMBOL, slot._slotName);
+    auto values = _env->generateConstantExpression(SYMBOL, ::EnvTrueSymbol(theEnv));
+    slotName->nextArg = values;
+    if (GetpType(value) == MULTIFIELD) {
+        EXPRESSION* last = nullptr;
+        for (auto i = GetpDOBegin(value); i <= GetpDOEnd(value); ++i) {
+            auto field = _env->generateConstantExpression(GetMFType(GetpValue(value), i), GetMFValue(GetpValue(value), i));
+            if (last) {
+                last->nextArg = field;
+            } else {
+                values->argList = field;
+            }
+            last = field;
+        }
+    } else {
+        values->argList = _env->generateConstantExpression(GetpType(value), GetpValue(value));
+    }
+    _env->installExpression(slotName);
+    if (_lastOverride) {
+        _lastOverride->nextArg = slotName;
+    } else {
+        _ref.argList->nextArg->nextArg = slotName;
+    }
+    _lastOverride = values;
+    return *this;
+}
+
+void
+InstanceBuilder::releaseOverrides()
+{
+    auto cls = _ref.argList->nextArg;
+    if (cls->nextArg) {
+        _env->deinstallExpression(cls->nextArg);
+        _env->reclaimExpressionList(cls->nextArg);
+        cls->nextArg = nullptr;
+    }
+    _lastOverride = nullptr;
+    auto theName = _ref.argList;
+    _env->deinstallAtom(theName->type, theName->value);
+    theName->type = _gensym.type;
+    theName->value = _gensym.value;
+}
+
+void*
+InstanceBuilder::makeInstance()
+{
+    DataObject result;
+    auto success = _env->evaluateExpression(&_ref, &result);
+    releaseOverrides();
+    if (!success || GetType(result) != INSTANCE_NAME) {
+        std::stringstream ss;
+        ss << "Could not make an instance of " << _className << "!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    auto instance = ::FindInstanceBySymbol(_env->getRawEnvironment(), static_cast<SYMBOL_HN*>(GetValue(result)));
+    if (!instance) {
+        std::stringstream ss;
+        ss << "Instance [" << DOToString(result) << "] of " << _className << " was deleted during initialization!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    return instance;
+}
+// end InstanceBuilder stuff
+
+// Begin Snapshot stuff
+/// @return an installed copy of the given value which does not share a multifield with anything
+static DataObject
+copyValue(void* theEnv, DataObject value)
+{
+    if (GetType(value) == MULTIFIELD) {
+        auto length = GetDOLength(value);
+        auto copy = ::EnvCreateMultifield(theEnv, length);
+        for (long i = 1; i <= length; ++i) {
+            SetMFType(copy, i, GetMFType(GetValue(value), GetDOBegin(value) + i - 1));
+            SetMFValue(copy, i, GetMFValue(GetValue(value), GetDOBegin(value) + i - 1));
+        }
+        SetpValue(&value, copy);
+        SetpDOBegin(&value, 1);
+        SetpDOEnd(&value, length);
+    }
+    ::ValueInstall(theEnv, &value);
+    return value;
+}
+
+/// atoms are unique so two values are the same if their types and atoms are
+static bool
+sameValue(DataObject& a, DataObject& b)
+{
+    if (GetType(a) != GetType(b)) {
+        return false;
+    }
+    if (GetType(a) != MULTIFIELD) {
+        return GetValue(a) == GetValue(b);
+    }
+    auto length = GetDOLength(a);
+    if (length != GetDOLength(b)) {
+        return false;
+    }
+    for (long i = 0; i < length; ++i) {
+        auto ia = GetDOBegin(a) + i;
+        auto ib = GetDOBegin(b) + i;
+        if (GetMFType(GetValue(a), ia) != GetMFType(GetValue(b), ib) || GetMFValue(GetValue(a), ia) != GetMFValue(GetValue(b), ib)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @return a new fact with the contents of the given one, ready to be asserted
+static void*
+duplicateFact(void* theEnv, void* fact)
+{
+    auto source = static_cast<struct fact*>(fact);
+    auto copy = static_cast<struct fact*>(::EnvCreateFact(theEnv, source->whichDeftemplate));
+    for (long i = 0; i < source->theProposition.multifieldLength; ++i) {
+        auto& from = source->theProposition.theFields[i];
+        auto& to = copy->theProposition.theFields[i];
+        to.type = from.type;
+        to.value = from.type == MULTIFIELD ? ::CopyMultifield(theEnv, static_cast<struct multifield*>(from.value)) : from.value;
+    }
+    return copy;
+}
+
+/// invoke fn with every construct the given iteration function walks in every module
+template<typename F>
+static void
+forEachConstruct(void* theEnv, void* (*next)(void*, void*), F fn)
 {
-    fn(this, dobj);
+    auto current = ::EnvGetCurrentModule(theEnv);
+    for (auto module = ::EnvGetNextDefmodule(theEnv, nullptr); module; module = ::EnvGetNextDefmodule(theEnv, module)) {
+        ::EnvSetCurrentModule(theEnv, module);
+        for (auto construct = next(theEnv, nullptr); construct; construct = next(theEnv, construct)) {
+            fn(construct);
+        }
+    }
+    ::EnvSetCurrentModule(theEnv, current);
 }
 
+WorkingMemorySnapshot::WorkingMemorySnapshot(WorkingMemorySnapshot&& other)
+{
+    takeFrom(other);
+}
 
-void
-Environment::unmakeInstance(void* instancePtr)
+WorkingMemorySnapshot&
+WorkingMemorySnapshot::operator=(WorkingMemorySnapshot&& other)
 {
-    ::EnvUnmakeInstance(env, instancePtr);
+    if (this != &other) {
+        release();
+        takeFrom(other);
+    }
+    return *this;
 }
 
 void
-Environment::buildAndExecuteFunction(const std::string& function)
+WorkingMemorySnapshot::attach(Environment* env)
 {
-    DataObject dontCare;
-    buildAndExecuteFunction(function, &dontCare);
+    _env = env;
+    _generation = env->state->generation;
+    env->state->snapshots.emplace_back(this);
 }
 
 void
-Environment::buildAndExecuteFunction(const std::string& function, DataObjectPtr ret)
+WorkingMemorySnapshot::takeFrom(WorkingMemorySnapshot& other)
 {
-    FunctionBuilder fb(this);
-    fb.setFunctionReference(function);
-    fb.invoke(ret);
+    if (!other._env) {
+        return;
+    }
+    auto& snapshots = other._env->state->snapshots;
+    std::replace(snapshots.begin(), snapshots.end(), &other, this);
+    _env = other._env;
+    _generation = other._generation;
+    _facts = std::move(other._facts);
+    _factSet = std::move(other._factSet);
+    _classes = std::move(other._classes);
+    _instances = std::move(other._instances);
+    _instancesByName = std::move(other._instancesByName);
+    _globals = std::move(other._globals);
+    other._env = nullptr;
 }
 
-int
-Environment::installExternalAddressType(Environment::ExternalAddressType* description)
+WorkingMemorySnapshot::~WorkingMemorySnapshot()
 {
-    return ::InstallExternalAddressType(env, description);
+    release();
 }
 
 bool
-Environment::checkArgument(const std::string& function, int position, int type, DataObjectPtr ptr)
+WorkingMemorySnapshot::isStale() const
 {
-    return EnvArgTypeCheck(env, function.c_str(), position, type, ptr) != FALSE;
+    return !_env || _env->getConstructGeneration() != _generation;
 }
 
-bool
-Environment::checkArgument(const std::string& function, int position, DataObjectType type, DataObjectPtr ptr)
+void
+WorkingMemorySnapshot::release()
 {
-    return checkArgument(function, position, static_cast<int>(type), ptr);
+    if (!_env) {
+        return;
+    }
+    auto theEnv = _env->getRawEnvironment();
+    for (auto fact : _facts) {
+        ::FactDeinstall(theEnv, static_cast<struct fact*>(fact));
+    }
+    for (auto& instance : _instances) {
+        for (auto& value : instance.values) {
+            ::ValueDeinstall(theEnv, &value);
+        }
+    }
+    for (auto& global : _globals) {
+        ::ValueDeinstall(theEnv, &global.value);
+    }
+    _facts.clear();
+    _factSet.clear();
+    _classes.clear();
+    _instances.clear();
+    _instancesByName.clear();
+    _globals.clear();
+    auto& snapshots = _env->state->snapshots;
+    snapshots.erase(std::remove(snapshots.begin(), snapshots.end(), this), snapshots.end());
+    _env = nullptr;
+}
+
+WorkingMemorySnapshot
+Environment::snapshot()
+{
+    WorkingMemorySnapshot result;
+    result.attach(this);
+    for (auto fact = ::EnvGetNextFact(env, nullptr); fact; fact = ::EnvGetNextFact(env, fact)) {
+        // installing keeps the slot values alive after the fact is retracted
+        ::FactInstall(env, static_cast<struct fact*>(fact));
+        result._facts.emplace_back(fact);
+        result._factSet.emplace(fact);
+    }
+    std::unordered_map<void*, size_t> classes;
+    DataObject value;
+    for (auto instance = ::EnvGetNextInstance(env, nullptr); instance; instance = ::EnvGetNextInstance(env, instance)) {
+        auto defclass = ::EnvGetInstanceClass(env, instance);
+        auto found = classes.find(defclass);
+        if (found == classes.end()) {
+            WorkingMemorySnapshot::ClassImage image;
+            // the qualified name lets make-instance find classes MAIN cannot see
+            std::string qualifiedName(::EnvDefclassModule(env, defclass));
+            qualifiedName.append("::").append(::EnvGetDefclassName(env, defclass));
+            image.defclass = DefclassHandle(this, qualifiedName, defclass, state->generation);
+            DataObject names;
+            ::EnvClassSlots(env, defclass, &names, TRUE);
+            for (long i = GetDOBegin(names); i <= GetDOEnd(names); ++i) {
+                auto slotName = ValueToString(GetMFValue(GetValue(names), i));
+                image.slots.emplace_back(findSlot(image.defclass, slotName));
+                // read-only slots cannot be overridden by make-instance and shared
+                // slots would be overwritten for the whole class
+                image.initable.emplace_back(::EnvSlotInitableP(env, defclass, slotName) && !::EnvSlotSharedP(env, defclass, slotName));
+            }
+            found = classes.emplace(defclass, result._classes.size()).first;
+            result._classes.emplace_back(std::move(image));
+        }
+        WorkingMemorySnapshot::InstanceImage image;
+        image.name = ::EnvGetInstanceName(env, instance);
+        image.classIndex = found->second;
+        for (auto const& slot : result._classes[found->second].slots) {
+            getSlot(instance, slot, &value);
+            image.values.emplace_back(copyValue(env, value));
+        }
+        result._instancesByName.emplace(image.name, result._instances.size());
+        result._instances.emplace_back(std::move(image));
+    }
+    forEachConstruct(env, ::EnvGetNextDefglobal, [this, &result, &value](void* defglobal) {
+                ::QGetDefglobalValue(env, defglobal, &value);
+                result._globals.emplace_back(WorkingMemorySnapshot::GlobalImage { defglobal, copyValue(env, value) });
+            });
+    return result;
 }
 
-bool
-Environment::argumentIsExternalAddress(const std::string& function, int position, DataObjectPtr ptr)
+RestoreStatistics
+Environment::restore(WorkingMemorySnapshot& snapshot)
 {
-    return checkArgument(function, position, EXTERNAL_ADDRESS, ptr);
+    if (snapshot._env != this) {
+        throw Problem("Attempted to restore a snapshot which was not taken from this environment!");
+    }
+    if (snapshot.isStale()) {
+        throw Problem("Attempted to restore a snapshot taken before the constructs of the environment changed!");
+    }
+    auto start = std::chrono::steady_clock::now();
+    RestoreStatistics result;
+    // like reset the focus goes back to MAIN before working memory changes, so that
+    // auto-focus rules activated by the restore can still push their modules
+    auto main = ::EnvFindDefmodule(env, "MAIN");
+    ::EnvSetCurrentModule(env, main);
+    ::EnvClearFocusStack(env);
+    ::EnvFocus(env, main);
+    restoreFacts(snapshot, result);
+    restoreInstances(snapshot, result);
+    if (::EnvGetResetGlobals(env)) {
+        restoreGlobals(snapshot, result);
+    }
+    // the matches of the snapshot which fired since are still in the network, only refraction keeps them off the agenda
+    forEachConstruct(env, ::EnvGetNextDefrule, [this](void* defrule) { ::EnvRefresh(env, defrule); });
+    result.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    return result;
 }
 
-bool
-Environment::installUserFunction(const std::string& name, int returnType, Environment::RawFunction body, const std::string& actualName, const char* restrictions)
+void
+Environment::restoreFacts(WorkingMemorySnapshot& snapshot, RestoreStatistics& result)
 {
-    return ::EnvDefineFunction2(env, name.c_str(), returnType, body, actualName.c_str(), restrictions);
+    std::vector<void*> added;
+    for (auto fact = ::EnvGetNextFact(env, nullptr); fact; fact = ::EnvGetNextFact(env, fact)) {
+        if (snapshot._factSet.find(fact) == snapshot._factSet.end()) {
+            added.emplace_back(fact);
+        }
+    }
+    for (auto fact : added) {
+        // retracting one fact may have taken others with it through logical support
+        if (!factExists(fact)) {
+            continue;
+        }
+        retractFact(fact);
+        ++result.factsRetracted;
+    }
+    for (auto& fact : snapshot._facts) {
+        if (factExists(fact)) {
+            continue;
+        }
+        auto asserted = ::EnvAssert(env, duplicateFact(env, fact));
+        if (!asserted) {
+            throw Problem("Could not assert a fact of the snapshot again!");
+        }
+        ::FactInstall(env, static_cast<struct fact*>(asserted));
+        ::FactDeinstall(env, static_cast<struct fact*>(fact));
+        snapshot._factSet.erase(fact);
+        snapshot._factSet.emplace(asserted);
+        fact = asserted;
+        ++result.factsAsserted;
+    }
 }
 
-bool
-Environment::installUserFunction(const std::string& name, UserFunctionReturnType returnType, Environment::RawFunction body, const std::string& actualName, const char* restrictions)
+void
+Environment::restoreInstances(WorkingMemorySnapshot& snapshot, RestoreStatistics& result)
 {
-   return installUserFunction(name, static_cast<int>(returnType), body, actualName, restrictions);
+    std::vector<void*> current;
+    for (auto instance = ::EnvGetNextInstance(env, nullptr); instance; instance = ::EnvGetNextInstance(env, instance)) {
+        current.emplace_back(instance);
+    }
+    std::vector<bool> seen(snapshot._instances.size(), false);
+    DataObject value;
+    for (auto instance : current) {
+        // the delete handlers of an instance removed earlier may have taken this one with it
+        if (!::EnvValidInstanceAddress(env, instance)) {
+            continue;
+        }
+        auto found = snapshot._instancesByName.find(::EnvGetInstanceName(env, instance));
+        if (found == snapshot._instancesByName.end() || snapshot._classes[snapshot._instances[found->second].classIndex].defclass.getRawDefclass() != ::EnvGetInstanceClass(env, instance)) {
+            ::EnvDeleteInstance(env, instance);
+            ++result.instancesDeleted;
+            continue;
+        }
+        seen[found->second] = true;
+        auto& image = snapshot._instances[found->second];
+        auto const& slots = snapshot._classes[image.classIndex].slots;
+        for (size_t i = 0; i < slots.size(); ++i) {
+            getSlot(instance, slots[i], &value);
+            if (!sameValue(value, image.values[i])) {
+                setSlot(instance, slots[i], &image.values[i]);
+                ++result.slotsRestored;
+            }
+        }
+    }
+    for (size_t index = 0; index < seen.size(); ++index) {
+        if (seen[index]) {
+            continue;
+        }
+        auto& image = snapshot._instances[index];
+        auto const& cls = snapshot._classes[image.classIndex];
+        InstanceBuilder ib(this, cls.defclass);
+        ib.setName(image.name);
+        for (size_t i = 0; i < cls.slots.size(); ++i) {
+            if (cls.initable[i]) {
+                ib.set(cls.slots[i], &image.values[i]);
+            }
+        }
+        ib.makeInstance();
+        ++result.instancesMade;
+    }
 }
 
-void*
-Environment::createMultifield(int32_t size)
-{
-    return ::EnvCreateMultifield(env, size);
+void
+Environment::restoreGlobals(WorkingMemorySnapshot& snapshot, RestoreStatistics& result)
+{
+    DataObject value;
+    for (auto& global : snapshot._globals) {
+        ::QGetDefglobalValue(env, global.defglobal, &value);
+        if (!sameValue(value, global.value)) {
+            ::QSetDefglobalValue(env, static_cast<struct defglobal*>(global.defglobal), &global.value, FALSE);
+            ++result.globalsRestored;
+        }
+    }
 }
+// end Snapshot stuff
 
-int
-Environment::getArgumentCount() const
+// Begin FunctionBuilder stuff
+FunctionBuilder::FunctionBuilder(Environment* e) : env(e)
 {
-    return ::EnvRtnArgCount(env);
+    _ref.type = RVOID;
+    _ref.value = nullptr;
+    _ref.argList = nullptr;
+    _ref.nextArg = nullptr;
 }
 
-// End Environment stuff
-
-// Begin FunctionBuilder stuff
-FunctionBuilder::FunctionBuilder(Environment* e) : env(e) { }
+FunctionBuilder::FunctionBuilder(Environment* e, const FunctionHandle& handle) : FunctionBuilder(e)
+{
+    setFunctionReference(handle);
+}
 
 FunctionBuilder::~FunctionBuilder()
 {
-    env->deinstallExpression(&_ref);
+    // only the arguments were installed, the function reference itself never is
+    env->deinstallExpression(_ref.argList);
     env->reclaimExpressionList(_ref.argList);
     _ref.argList = nullptr;
     curr = nullptr;
@@ -375,21 +2035,63 @@ FunctionBuilder::~FunctionBuilder()
 void
 FunctionBuilder::setFunctionReference(const std::string& func)
 {
-    if (!env->generateFunctionExpression(func, &_ref)) {
+    // resolve into a scratch reference, GetFunctionReference clears argList
+    // and the arguments bound so far must survive retargeting the builder
+    FUNCTION_REFERENCE ref;
+    if (!env->generateFunctionExpression(func, &ref)) {
         std::stringstream ss;
         ss << "Function " << func << " does not exist!!!!";
         auto str = ss.str();
         throw Problem(str);
     } else {
-        _function = func;
+        _ref.type = ref.type;
+        _ref.value = ref.value;
+        _ref.nextArg = nullptr;
         functionReferenceSet = true;
     }
 }
 
+void
+FunctionBuilder::setFunctionReference(const FunctionHandle& handle)
+{
+    handle.ensureValid(env);
+    _ref.type = handle._ref.type;
+    _ref.value = handle._ref.value;
+    _ref.nextArg = nullptr;
+    functionReferenceSet = true;
+}
+
+std::string
+FunctionBuilder::getFunctionName() const
+{
+    auto theEnv = env->getRawEnvironment();
+    switch (_ref.type) {
+        case FCALL:
+            return ValueToString(ExpressionFunctionCallName(&_ref));
+        case PCALL:
+            return ::EnvGetDeffunctionName(theEnv, _ref.value);
+        case GCALL:
+            return ::EnvGetDefgenericName(theEnv, _ref.value);
+        default:
+            return "<unknown function>";
+    }
+}
+
 void
 FunctionBuilder::installArgument(uint16_t type, void* value)
 {
     if (functionReferenceSet) {
+        auto reusable = curr ? curr->nextArg : _ref.argList;
+        if (reusable) {
+            // rebind the expression left over from a previous invocation,
+            // install first in case the old and new value are the same atom
+            env->installAtom(type, value);
+            env->deinstallAtom(reusable->type, reusable->value);
+            reusable->type = type;
+            reusable->value = value;
+            curr = reusable;
+            return;
+        }
         auto tmp = env->generateConstantExpression(type, value);
         env->installExpression(tmp);
         if (_ref.argList == nullptr) {
@@ -410,6 +2112,29 @@ FunctionBuilder::installArgument(DataObjectType type, void* value)
     installArgument(static_cast<uint16_t>(type), value);
 }
 
+void
+FunctionBuilder::rewind()
+{
+    curr = nullptr;
+}
+
+void
+FunctionBuilder::releaseUnboundArguments()
+{
+    EXPRESSION* unbound = nullptr;
+    if (curr) {
+        unbound = curr->nextArg;
+        curr->nextArg = nullptr;
+    } else {
+        unbound = _ref.argList;
+        _ref.argList = nullptr;
+    }
+    if (unbound) {
+        env->deinstallExpression(unbound);
+        env->reclaimExpressionList(unbound);
+    }
+}
+
 void
 FunctionBuilder::addArgument(bool value)
 {
@@ -443,68 +2168,102 @@ FunctionBuilder::addArgument(const char* str)
 void
 FunctionBuilder::addArgument(const std::string& str)
 {
-    addArgument(str.c_str());
+    installArgument(STRING, env->addSymbol(str));
 }
 
 void
-FunctionBuilder::invoke(DataObjectPtr ret)
+FunctionBuilder::addArgument(SymbolId value)
+{
+    installArgument(SYMBOL, env->addSymbol(value));
+}
+
+bool
+FunctionBuilder::tryInvoke(DataObjectPtr ret)
 {
     if (!functionReferenceSet) {
         throw Problem("ERROR: attempted to invoke a function builder without setting its function!");
-    } else if (!env->evaluateExpression(&_ref, ret)) {
-        std::stringstream command;
-        command << "(" << _function << " ";
-        auto installArgument = [&command](const std::string& prefix, std::function<void(std::stringstream&)> body, const std::string& suffix) {
-            command << " " << prefix;
-            body(command);
-            command << suffix << " ";
-        };
-        auto installAddress = [installArgument](const std::string& type, void* value) {
-            installArgument(type + "<0x", [value](std::stringstream& stream) { stream << std::hex << value; }, ">");
-        };
-        for (auto args = _ref.argList; args; args = args->nextArg) {
-            auto aType = static_cast<DataObjectType>(args->type);
-            switch (aType) {
-                case DataObjectType::String:
-                    installArgument("\"", [args](std::stringstream& stream) { stream << DOPToString(args); }, "\"");
-                    break;
-                case DataObjectType::Symbol:
-                    installArgument("", [args](std::stringstream& stream) { stream << DOPToString(args); }, "");
-                    break;
-                case DataObjectType::InstanceName:
-                    installArgument("[", [args](std::stringstream& stream) { stream << DOPToString(args); }, "]");
-                    break;
-                case DataObjectType::Integer:
-                    installArgument("", [args](std::stringstream& stream) { stream << DOPToInteger(args); }, "");
-                    break;
-                case DataObjectType::Float:
-                    installArgument("", [args](std::stringstream& stream) { stream << DOPToDouble(args); }, "");
-                    break;
-                case DataObjectType::InstanceAddress:
-                    installAddress("InstanceAddress", args->value);
-                    break;
-                case DataObjectType::ExternalAddress:
-                    installAddress("ExternalAddress", args->value);
-                    break;
-                case DataObjectType::Multifield:
-                    /// @todo When we need to do multifield walking in a
-                    ///  function then modify this case to perform the walking
-                    installAddress("MULTIFIELD", args->value);
-                    break;
-                default:
-                    installAddress("UNKNOWN_TYPE", args->value);
-                    break;
-            }
-        }
-        command << ")";
-        auto str = command.str();
-        std::stringstream ss;
-        ss << "ERROR: invocation of " << str << " yielded an error!";
-        auto tmp = ss.str();
+    }
+    releaseUnboundArguments();
+    if (!env->isProfiling()) {
+        return env->evaluateExpression(&_ref, ret);
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto result = env->evaluateExpression(&_ref, ret);
+    env->recordInvocation(*this, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start));
+    return result;
+}
+
+void
+FunctionBuilder::invoke(DataObjectPtr ret)
+{
+    if (!tryInvoke(ret)) {
+        // the arguments are released when the builder unwinds so the text cannot be deferred,
+        // callers for which failures are routine should use the nothrow overload instead
+        auto tmp = describeFailure();
         throw Problem(tmp);
     }
 }
 
+CallError
+FunctionBuilder::invoke(DataObjectPtr ret, std::nothrow_t)
+{
+    if (!functionReferenceSet) {
+        return CallError::NoFunction;
+    }
+    return tryInvoke(ret) ? CallError::None : CallError::EvaluationFailed;
+}
+
+/// write a single argument of a call the way it would be typed in CLIPS
+static void
+describeArgument(std::ostream& stream, EXPRESSION* arg)
+{
+    switch (static_cast<DataObjectType>(arg->type)) {
+        case DataObjectType::String:
+            stream << "\"" << DOPToString(arg) << "\"";
+            break;
+        case DataObjectType::Symbol:
+            stream << DOPToString(arg);
+            break;
+        case DataObjectType::InstanceName:
+            stream << "[" << DOPToString(arg) << "]";
+            break;
+        case DataObjectType::Integer:
+            stream << DOPToInteger(arg);
+            break;
+        case DataObjectType::Float:
+            stream << DOPToDouble(arg);
+            break;
+        case DataObjectType::InstanceAddress:
+            stream << "InstanceAddress<0x" << std::hex << arg->value << std::dec << ">";
+            break;
+        case DataObjectType::ExternalAddress:
+            stream << "ExternalAddress<0x" << std::hex << arg->value << std::dec << ">";
+            break;
+        case DataObjectType::Multifield:
+            /// @todo When we need to do multifield walking in a
+            ///  function then modify this case to perform the walking
+            stream << "MULTIFIELD<0x" << std::hex << arg->value << std::dec << ">";
+            break;
+        default:
+            stream << "UNKNOWN_TYPE<0x" << std::hex << arg->value << std::dec << ">";
+            break;
+    }
+}
+
+std::string
+FunctionBuilder::describeFailure() const
+{
+    std::stringstream ss;
+    ss << "ERROR: invocation of (" << getFunctionName() << " ";
+    for (auto args = _ref.argList; args; args = args->nextArg) {
+        ss << " ";
+        describeArgument(ss, args);
+        ss << " ";
+    }
+    ss << ") yielded an error!";
+    return ss.str();
+}
+
 void
 FunctionBuilder::addArgument(int32_t value)
 {
@@ -512,7 +2271,7 @@ FunctionBuilder::addArgument(int32_t value)
 }
 
 void
-FunctionBuilder::addArgument(std::function<void(FunctionBuilder*)> fn)
+FunctionBuilder::addArgument(const std::function<void(FunctionBuilder*)>& fn)
 {
     fn(this);
 }
@@ -520,6 +2279,19 @@ FunctionBuilder::addArgument(std::function<void(FunctionBuilder*)> fn)
 // end FunctionBuilder stuff
 
 
+template<typename T>
+void
+reserveSpace(T&, size_t)
+{
+}
+
+template<typename T>
+void
+reserveSpace(std::vector<T>& container, size_t count)
+{
+    container.reserve(container.size() + count);
+}
+
 template<typename T>
 void
 populateStringContainer(void* env, DataObjectPtr dobj, T& container)
@@ -527,6 +2299,9 @@ populateStringContainer(void* env, DataObjectPtr dobj, T& container)
     int end = GetDOEnd(*dobj),
         begin = GetDOBegin(*dobj);
     void* multifield = GetValue(*dobj);
+    if (end >= begin) {
+        reserveSpace(container, end - begin + 1);
+    }
     for (int i = begin; i <= end; ++i) {
         container.emplace_back(ValueToString(EnvGetMFValue(env, multifield, i)));
     }
@@ -562,6 +2337,126 @@ extractData(Environment* env, DataObjectPtr dobj, std::stringstream& value)
     populateStringContainer(env->getRawEnvironment(), dobj, value);
 }
 
+void
+extractData(Environment*, DataObjectPtr dobj, MultifieldView& view)
+{
+    view = MultifieldView(dobj);
+}
+
+/// @return the number of fields of the given type
+static size_t
+countFieldsOfType(const struct field* fields, size_t count, unsigned short type)
+{
+    size_t matches = 0;
+    for (size_t i = 0; i < count; ++i) {
+        matches += (fields[i].type == type) ? 1 : 0;
+    }
+    return matches;
+}
+
+/// Copy an all integer multifield into the given memory, the types are
+/// checked up front so the copy loop itself has no branches
+static void
+copyIntegers(const MultifieldView& view, int64_t* out)
+{
+    auto fields = view.getRawFields();
+    auto count = view.size();
+    if (countFieldsOfType(fields, count, INTEGER) != count) {
+        throw Problem("Attempted to extract integers from a multifield which contains non integer values!");
+    }
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = ValueToLong(fields[i].value);
+    }
+}
+
+/// Copy a numeric multifield into the given memory, the common all float
+/// case gets a branch free copy loop
+template<typename T>
+static void
+copyFloats(const MultifieldView& view, T* out)
+{
+    auto fields = view.getRawFields();
+    auto count = view.size();
+    auto floats = countFieldsOfType(fields, count, FLOAT);
+    if (floats == count) {
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = static_cast<T>(ValueToDouble(fields[i].value));
+        }
+    } else if (floats + countFieldsOfType(fields, count, INTEGER) == count) {
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = static_cast<T>(fields[i].type == FLOAT ? ValueToDouble(fields[i].value) : ValueToLong(fields[i].value));
+        }
+    } else {
+        throw Problem("Attempted to extract numbers from a multifield which contains non numeric values!");
+    }
+}
+
+template<typename T, typename F>
+static void
+appendNumbers(DataObjectPtr dobj, std::vector<T>& list, F copy)
+{
+    MultifieldView view(dobj);
+    auto offset = list.size();
+    list.resize(offset + view.size());
+    try {
+        copy(view, list.data() + offset);
+    } catch (...) {
+        list.resize(offset);
+        throw;
+    }
+}
+
+template<typename T, typename F>
+static void
+fillBuffer(DataObjectPtr dobj, MultifieldBuffer<T>& buffer, F copy)
+{
+    MultifieldView view(dobj);
+    if (view.size() > buffer.capacity) {
+        std::stringstream ss;
+        ss << "Attempted to extract a multifield of " << view.size() << " elements into a buffer of " << buffer.capacity << " elements!";
+        auto str = ss.str();
+        throw Problem(str);
+    }
+    copy(view, buffer.data);
+    buffer.length = view.size();
+}
+
+void
+extractData(Environment*, DataObjectPtr dobj, std::vector<int64_t>& list)
+{
+    appendNumbers(dobj, list, copyIntegers);
+}
+
+void
+extractData(Environment*, DataObjectPtr dobj, std::vector<double>& list)
+{
+    appendNumbers(dobj, list, copyFloats<double>);
+}
+
+void
+extractData(Environment*, DataObjectPtr dobj, std::vector<float>& list)
+{
+    appendNumbers(dobj, list, copyFloats<float>);
+}
+
+void
+extractData(Environment*, DataObjectPtr dobj, MultifieldBuffer<int64_t>& buffer)
+{
+    fillBuffer(dobj, buffer, copyIntegers);
+}
+
+void
+extractData(Environment*, DataObjectPtr dobj, MultifieldBuffer<double>& buffer)
+{
+    fillBuffer(dobj, buffer, copyFloats<double>);
+}
+
+void
+extractData(Environment*, DataObjectPtr dobj, MultifieldBuffer<float>& buffer)
+{
+    fillBuffer(dobj, buffer, copyFloats<float>);
+}
+
 void
 extractData(Environment* env, DataObjectPtr dobj, int32_t& value)
 {
@@ -606,9 +2501,45 @@ extractData(Environment* env, DataObjectPtr dobj, bool& value) {
     value = (dobj->value != (void*)(EnvFalseSymbol(env->getRawEnvironment()))) && (dobj->type == SYMBOL);
 }
 
+// begin MultifieldView stuff
+
+MultifieldView::MultifieldView(DataObjectPtr dobj)
+{
+    if (GetpType(dobj) != MULTIFIELD) {
+        throw Problem("Attempted to view a data object which does not contain a multifield!");
+    }
+    auto begin = GetpDOBegin(dobj),
+         end = GetpDOEnd(dobj);
+    _begin = GetMFPtr(GetpValue(dobj), begin);
+    _size = end >= begin ? static_cast<size_t>(end - begin + 1) : 0;
+}
+
 // begin MultifieldBuilder stuff
 
-MultifieldBuilder::MultifieldBuilder(Environment* env, int32_t size) : MultifieldBuilder(env->createMultifield(size)) { }
+MultifieldBuilder::MultifieldBuilder(Environment* env, int32_t size) : _env(env), _rawMultifield(env->createMultifield(size)) { }
+
+int32_t
+MultifieldBuilder::size() const
+{
+    return static_cast<int32_t>(GetMFLength(_rawMultifield));
+}
+
+DataObject
+MultifieldBuilder::toDataObject() const
+{
+    DataObject ret;
+    toDataObject(&ret);
+    return ret;
+}
+
+void
+MultifieldBuilder::toDataObject(DataObjectPtr ret) const
+{
+    SetDataObjectType(ret, DataObjectType::Multifield);
+    SetDataObjectValue(ret, _rawMultifield);
+    SetpDOBegin(ret, 1);
+    SetpDOEnd(ret, size());
+}
 
 void
 MultifieldBuilder::setField(DataObjectType type, int index, void* value) {
@@ -617,6 +2548,86 @@ MultifieldBuilder::setField(DataObjectType type, int index, void* value) {
 }
 
 
+// begin injectData stuff
+
+void
+injectData(Environment* env, DataObjectPtr ret, int32_t value)
+{
+    SetDataObjectType(ret, DataObjectType::Integer);
+    SetDataObjectValue(ret, env->addNumber(value));
+}
+
+void
+injectData(Environment* env, DataObjectPtr ret, int64_t value)
+{
+    SetDataObjectType(ret, DataObjectType::Integer);
+    SetDataObjectValue(ret, env->addNumber(value));
+}
+
+void
+injectData(Environment* env, DataObjectPtr ret, uint32_t value)
+{
+    SetDataObjectType(ret, DataObjectType::Integer);
+    SetDataObjectValue(ret, env->addNumber(value));
+}
+
+void
+injectData(Environment* env, DataObjectPtr ret, float value)
+{
+    SetDataObjectType(ret, DataObjectType::Float);
+    SetDataObjectValue(ret, env->addNumber(value));
+}
+
+void
+injectData(Environment* env, DataObjectPtr ret, double value)
+{
+    SetDataObjectType(ret, DataObjectType::Float);
+    SetDataObjectValue(ret, env->addNumber(value));
+}
+
+void
+injectData(Environment* env, DataObjectPtr ret, bool value)
+{
+    auto theEnv = env->getRawEnvironment();
+    SetDataObjectType(ret, DataObjectType::Symbol);
+    SetDataObjectValue(ret, value ? ::EnvTrueSymbol(theEnv) : ::EnvFalseSymbol(theEnv));
+}
+
+void
+injectData(Environment* env, DataObjectPtr ret, const char* value)
+{
+    SetDataObjectType(ret, DataObjectType::String);
+    SetDataObjectValue(ret, env->addSymbol(value));
+}
+
+void
+injectData(Environment* env, DataObjectPtr ret, const std::string& value)
+{
+    SetDataObjectType(ret, DataObjectType::String);
+    SetDataObjectValue(ret, env->addSymbol(value));
+}
+
+void
+injectData(Environment* env, DataObjectPtr ret, SymbolId value)
+{
+    SetDataObjectType(ret, DataObjectType::Symbol);
+    SetDataObjectValue(ret, env->addSymbol(value));
+}
+
+void
+injectData(Environment*, DataObjectPtr ret, const MultifieldBuilder& value)
+{
+    value.toDataObject(ret);
+}
+
+void
+injectData(Environment*, DataObjectPtr ret, const DataObject& value)
+{
+    *ret = value;
+}
+
+// end injectData stuff
+
 void
 SetDataObjectType(DataObjectPtr ptr, DataObjectType type)
 {
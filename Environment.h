@@ -24,16 +24,29 @@
 
 #ifndef __LibNeutron_Environment_h__
 #define __LibNeutron_Environment_h__
+#include <array>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <list>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <tuple>
 #include <utility>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <typeinfo>
 #include <exception>
+#include <iterator>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <type_traits>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 extern "C" {
     #include "clips.h"
@@ -45,21 +58,51 @@ namespace Neutron
 class Problem : public std::exception {
 public:
     explicit Problem(const std::string& msg) noexcept : _msg(msg) { }
+
+    /**
+     * Construct a Problem whose message is only formatted the first time it
+     * is asked for. Errors which are caught and dropped never pay for the
+     * formatting, so the formatter must only capture values that outlive the
+     * Problem. Asking for the message is not safe from several threads at once.
+     */
+    explicit Problem(std::function<std::string()> format) noexcept : _format(std::move(format)) { }
     virtual ~Problem() noexcept { }
 
     /**
      * @return a std::string descripting the message
      */
-    std::string message() const         { return _msg; }
+    std::string message() const         { return what(); }
 
-    virtual const char* what() const noexcept final { return _msg.c_str(); }
+    virtual const char* what() const noexcept final
+    {
+        if (_format) {
+            auto format = std::move(_format);
+            _format = nullptr;
+            try {
+                _msg = format();
+            } catch (...) {
+                _msg = "ERROR: the description of this problem could not be formatted!";
+            }
+        }
+        return _msg.c_str();
+    }
 
     /**
      * Problem objects, (and their derivatives), should not be assigned
      */
     Problem& operator=(const Problem&) = delete;
 private:
-    std::string _msg;
+    mutable std::string _msg;
+    mutable std::function<std::string()> _format;
+};
+
+/// Why a call made through one of the non throwing entry points failed
+enum class CallError : int {
+    None = 0,
+    /// there was no function to call
+    NoFunction,
+    /// CLIPS signalled an error while evaluating the call
+    EvaluationFailed,
 };
 
 using DataObject = DATA_OBJECT;
@@ -88,19 +131,481 @@ enum class DataObjectType : int {
 void SetDataObjectType(DataObjectPtr ptr, DataObjectType type);
 void SetDataObjectValue(DataObjectPtr ptr, void* value);
 
+/**
+ * A non owning view of the characters of a CLIPS symbol, string, or instance
+ * name. The characters remain valid for as long as the CLIPS value they came
+ * from is alive.
+ */
+class StringView
+{
+public:
+    StringView() = default;
+    explicit StringView(const char* data) : _data(data) { }
+
+    const char* data() const { return _data; }
+    /// @return the number of characters, this walks the characters every time
+    size_t size() const { return _data ? std::strlen(_data) : 0; }
+    bool empty() const { return !_data || *_data == '\0'; }
+
+    /// @return an owning copy of the characters
+    std::string str() const { return _data ? std::string(_data) : std::string(); }
+
+    bool operator==(const char* other) const { return std::strcmp(_data ? _data : "", other) == 0; }
+    bool operator!=(const char* other) const { return !(*this == other); }
+    bool operator==(const std::string& other) const { return other == (_data ? _data : ""); }
+    bool operator!=(const std::string& other) const { return !(*this == other); }
+#if __cplusplus >= 201703L
+    operator std::string_view() const { return _data ? std::string_view(_data) : std::string_view(); }
+#endif
+private:
+    const char* _data = nullptr;
+};
+
+/**
+ * A single field of a multifield as seen through a MultifieldView.
+ */
+class MultifieldElement
+{
+public:
+    explicit MultifieldElement(struct field* theField) : _field(theField) { }
+
+    DataObjectType getType() const { return static_cast<DataObjectType>(_field->type); }
+    void* getRawValue() const { return _field->value; }
+
+    /// @return true if the field holds a symbol, string, or instance name
+    bool isLexeme() const { return _field->type == SYMBOL || _field->type == STRING || _field->type == INSTANCE_NAME; }
+    /// @return true if the field holds an integer or a float
+    bool isNumber() const { return _field->type == INTEGER || _field->type == FLOAT; }
+
+    /// @return the characters of a symbol, string, or instance name field without copying them
+    StringView asString() const { return StringView(ValueToString(_field->value)); }
+    int64_t asInteger() const { return _field->type == FLOAT ? static_cast<int64_t>(ValueToDouble(_field->value)) : ValueToLong(_field->value); }
+    double asFloat() const { return _field->type == INTEGER ? static_cast<double>(ValueToLong(_field->value)) : ValueToDouble(_field->value); }
+private:
+    struct field* _field;
+};
+
+/**
+ * A view over the fields of a multifield data object which does not copy or
+ * allocate anything. The view is only valid while the multifield it
+ * refers to is alive.
+ */
+class MultifieldView
+{
+public:
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = MultifieldElement;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = MultifieldElement;
+
+        explicit const_iterator(struct field* curr) : _curr(curr) { }
+        MultifieldElement operator*() const { return MultifieldElement(_curr); }
+        const_iterator& operator++() { ++_curr; return *this; }
+        const_iterator operator++(int) { auto tmp = *this; ++_curr; return tmp; }
+        bool operator==(const const_iterator& other) const { return _curr == other._curr; }
+        bool operator!=(const const_iterator& other) const { return _curr != other._curr; }
+    private:
+        struct field* _curr;
+    };
+public:
+    MultifieldView() = default;
+    /// @throw Problem the data object does not contain a multifield
+    explicit MultifieldView(DataObjectPtr dobj);
+
+    const_iterator begin() const { return const_iterator(_begin); }
+    const_iterator end() const { return const_iterator(_begin + _size); }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    MultifieldElement operator[](size_t index) const { return MultifieldElement(_begin + index); }
+    /// @return the first field of the view, USE ONLY IN CASES WHERE FUNCTIONALITY IS MISSING IN THIS CLASS
+    struct field* getRawFields() const { return _begin; }
+private:
+    struct field* _begin = nullptr;
+    size_t _size = 0;
+};
+
 
 
 class Environment;
+
+/// The type returned by calling F as F(Environment&), std::result_of is
+/// deprecated in C++17 so std::invoke_result is used where it exists
+template<typename F>
+struct EnvironmentCallResult
+{
+#if __cplusplus >= 201703L
+    using type = typename std::invoke_result<F, Environment&>::type;
+#else
+    using type = typename std::result_of<F(Environment&)>::type;
+#endif
+};
+
+/**
+ * Caller owned memory that a numeric multifield is copied into by
+ * extractData.
+ */
+template<typename T>
+struct MultifieldBuffer
+{
+    MultifieldBuffer(T* d, size_t cap) : data(d), capacity(cap) { }
+    T* data;
+    size_t capacity;
+    /// the number of elements written by the last extraction
+    size_t length = 0;
+};
+
+/// Timing gathered for a single rule or function while profiling
+struct ProfileEntry
+{
+    std::string name;
+    /// number of rule firings or function invocations
+    uint64_t count = 0;
+    std::chrono::nanoseconds totalTime{0};
+    std::chrono::nanoseconds maxTime{0};
+};
+
+/// Everything recorded since profiling was enabled or the profile was last reset
+struct ProfileSnapshot
+{
+    std::vector<ProfileEntry> rules;
+    std::vector<ProfileEntry> functions;
+};
+
+/**
+ * Profile entries keyed by the raw construct they belong to so recording a
+ * sample is a single hash lookup. Constructs can go away whenever the
+ * environment is cleared or loaded into, so entries from an older generation
+ * are folded into retired by name instead of being trusted.
+ */
+struct ProfileTable
+{
+    std::unordered_map<void*, ProfileEntry> live;
+    std::map<std::string, ProfileEntry> retired;
+    uint64_t generation = 0;
+};
+
+/**
+ * The state of a user function defined through Environment::defineFunction,
+ * CLIPS hands it back to the trampoline as the function context.
+ */
+struct UserFunctionBinding
+{
+    explicit UserFunctionBinding(const std::string& n) : name(n) { }
+    virtual ~UserFunctionBinding() = default;
+    /// CLIPS keeps a pointer to the name instead of copying it
+    std::string name;
+};
+
+/**
+ * Key of the symbol cache, it does not own its characters: a stored key
+ * points at the contents of the CLIPS symbol it maps to, which stays valid
+ * as long as the cache holds its reference, and a lookup key points at the
+ * caller's string so finding a cached symbol never allocates.
+ */
+struct SymbolCacheKey
+{
+    const char* data;
+    size_t length;
+};
+
+struct SymbolCacheKeyHash
+{
+    size_t operator()(const SymbolCacheKey& key) const;
+};
+
+struct SymbolCacheKeyEqual
+{
+    bool operator()(const SymbolCacheKey& a, const SymbolCacheKey& b) const
+    {
+        return a.length == b.length && std::memcmp(a.data, b.data, a.length) == 0;
+    }
+};
+
+class WorkingMemorySnapshot;
+
+/// A function reference resolved by Environment::call for one declared function
+struct BoundFunctionReference
+{
+    FUNCTION_REFERENCE ref;
+    /// the construct generation ref was resolved in
+    uint64_t generation = 0;
+    bool resolved = false;
+};
+
+/**
+ * Bookkeeping shared by every Environment wrapper of the same raw CLIPS
+ * environment. It lives inside the CLIPS environment data table so it is
+ * reclaimed when the underlying environment is destroyed.
+ */
+struct EnvironmentState
+{
+    /// bumped whenever cached construct pointers may have become stale
+    uint64_t generation = 0;
+
+    /// consult symbolCache from addSymbol
+    bool symbolCacheEnabled = false;
+    /// upper bound on the number of strings kept in symbolCache
+    size_t symbolCacheLimit = 0;
+    /// strings interned through addSymbol, each entry holds a CLIPS reference
+    std::unordered_map<SymbolCacheKey, void*, SymbolCacheKeyHash, SymbolCacheKeyEqual> symbolCache;
+    /// symbols interned through registerSymbol, each entry holds a CLIPS reference
+    std::vector<void*> registeredSymbols;
+    uint64_t symbolCacheHits = 0;
+    uint64_t symbolCacheMisses = 0;
+
+    /// external address type ids indexed by TypeId, -1 marks a type which was never registered
+    std::vector<int> externalAddressIds;
+
+    /// asked after every rule firing of a bounded run whether to stop
+    const std::function<bool()>* runPredicate = nullptr;
+    /// the bounded run was halted by runPredicate
+    bool runInterrupted = false;
+    /// thrown by runPredicate, rethrown once control is back in C++
+    std::exception_ptr runFailure;
+
+    /// record rule firings and FunctionBuilder invocations
+    bool profiling = false;
+    ProfileTable ruleProfile;
+    ProfileTable functionProfile;
+    /// the rule which is firing right now and when it started
+    void* firingRule = nullptr;
+    std::chrono::steady_clock::time_point firingStart;
+    /// the user functions defined through defineFunction, owned until the environment goes away
+    std::vector<std::unique_ptr<UserFunctionBinding>> userFunctions;
+
+    /// keep released expression nodes on expressionPool instead of returning them to CLIPS
+    bool expressionPoolEnabled = false;
+    /// upper bound on the number of nodes kept in expressionPool
+    size_t expressionPoolLimit = 0;
+    /// released expression nodes chained through nextArg
+    EXPRESSION* expressionPool = nullptr;
+    size_t expressionPoolSize = 0;
+    uint64_t expressionsRecycled = 0;
+    uint64_t expressionsAllocated = 0;
+
+    /// the functions called through Environment::call indexed by the TypeId of their tag
+    std::vector<BoundFunctionReference> boundFunctions;
+    /// the snapshots taken from this environment, released as soon as they become stale
+    std::vector<WorkingMemorySnapshot*> snapshots;
+};
+
+/// Hands out the indices used by TypeId, safe to call from any thread
+size_t allocateTypeId();
+
+/**
+ * A small dense index for the type T which is assigned the first time it is
+ * asked for and never changes afterwards. It is used to address per
+ * environment tables in constant time instead of going through a map.
+ */
+template<typename T>
+struct TypeId
+{
+    static size_t value()
+    {
+        // function local statics are initialized exactly once even with several threads
+        static const size_t id = allocateTypeId();
+        return id;
+    }
+};
+
+/**
+ * The id of a symbol registered ahead of time through
+ * Environment::registerSymbol. Passing it as an argument installs the
+ * already interned symbol without touching the CLIPS symbol table.
+ */
+struct SymbolId
+{
+    size_t index;
+};
+
+/// Counters describing how well the symbol cache is doing
+struct SymbolCacheStatistics
+{
+    uint64_t hits;
+    uint64_t misses;
+    /// number of strings currently cached by addSymbol
+    size_t cachedSymbols;
+    /// number of symbols registered through registerSymbol
+    size_t registeredSymbols;
+};
+
+/// Counters describing how well the expression pool is doing
+struct ExpressionPoolStatistics
+{
+    /// nodes handed out from the pool, each one is an allocation CLIPS did not have to make
+    uint64_t recycled;
+    /// nodes which had to be allocated by CLIPS
+    uint64_t allocated;
+    /// number of nodes currently waiting in the pool
+    size_t pooled;
+};
+
+/**
+ * Common base of the handles which cache pointers into an environment. Handles
+ * become stale when the environment is cleared or new constructs are loaded
+ * and must be looked up again after that. Calling build or an undef* command
+ * through funcall also makes them stale; constructs changed any other way
+ * (from a rule, eval or a batch file) are not noticed until
+ * Environment::invalidateConstructHandles is called.
+ */
+class ConstructHandle
+{
+public:
+    /// @return the name the handle was looked up with
+    const std::string& getName() const { return _name; }
+
+    /// @return true if the handle can still be used with its environment
+    bool isValid() const;
+
+    /// @throw Problem the handle is stale
+    void ensureValid() const;
+
+    /// @throw Problem the handle is stale or was looked up in another CLIPS environment
+    void ensureValid(Environment* env) const;
+
+    /// @return the CLIPS environment the handle was looked up in
+    void* getRawEnvironment() const { return _rawEnv; }
+protected:
+    ConstructHandle() = default;
+    ConstructHandle(Environment* env, const std::string& name, uint64_t generation);
+protected:
+    /// the raw environment and its shared bookkeeping, not the wrapper the
+    /// handle was looked up through which may be gone long before the handle
+    void* _rawEnv = nullptr;
+    EnvironmentState* _state = nullptr;
+    std::string _name;
+    uint64_t _generation = 0;
+};
+
+/**
+ * A function reference which has been resolved once by name so that repeated
+ * invocations do not have to perform the lookup again.
+ */
+class FunctionHandle : public ConstructHandle
+{
+public:
+    FunctionHandle() = default;
+private:
+    friend class Environment;
+    friend class FunctionBuilder;
+    FunctionHandle(Environment* env, const std::string& name, const FUNCTION_REFERENCE& ref, uint64_t generation);
+    FUNCTION_REFERENCE _ref;
+};
+
+/**
+ * A deftemplate which has been looked up once by name.
+ */
+class DeftemplateHandle : public ConstructHandle
+{
+public:
+    DeftemplateHandle() = default;
+    void* getRawDeftemplate() const { return _deftemplate; }
+private:
+    friend class Environment;
+    DeftemplateHandle(Environment* env, const std::string& name, void* deftemplate, uint64_t generation) : ConstructHandle(env, name, generation), _deftemplate(deftemplate) { }
+    void* _deftemplate = nullptr;
+};
+
+/**
+ * A slot of a deftemplate which has been resolved to its position once so that
+ * it can be accessed without looking up the slot name.
+ */
+class FactSlotHandle : public ConstructHandle
+{
+public:
+    FactSlotHandle() = default;
+    void* getRawDeftemplate() const { return _deftemplate; }
+    bool isMultislot() const { return _multislot; }
+private:
+    friend class Environment;
+    friend class FactBuilder;
+    FactSlotHandle(Environment* env, const std::string& name, void* deftemplate, short position, bool multislot, uint64_t generation) : ConstructHandle(env, name, generation), _deftemplate(deftemplate), _position(position), _multislot(multislot) { }
+    void* _deftemplate = nullptr;
+    /// one based position of the slot within the fact
+    short _position = 0;
+    bool _multislot = false;
+};
+
+/**
+ * Tags the wrapped value so that it is passed to CLIPS as a symbol instead of a
+ * string. When built from an lvalue only a reference is kept, so the tag must
+ * not outlive the thing it refers to.
+ */
+template<typename T>
+struct Symbol
+{
+    T value;
+};
+
+/**
+ * Tags the wrapped value so that it is passed to CLIPS as an instance name.
+ * When built from an lvalue only a reference is kept.
+ */
+template<typename T>
+struct InstanceName
+{
+    T value;
+};
+
+/**
+ * Tags the given pointer so that it is passed to CLIPS as an external address
+ * of the type registered for T.
+ */
+template<typename T>
+struct ExternalAddress
+{
+    T* value;
+};
+
+/**
+ * A pair of iterators whose elements are passed to CLIPS as individual
+ * arguments.
+ */
+template<typename I>
+struct Range
+{
+    I begin;
+    I end;
+};
+
+/// Compile time list of indices, used to unpack tuples
+template<size_t ... Indices>
+struct IndexSequence { };
+
+template<size_t N, size_t ... Indices>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Indices...> { };
+
+template<size_t ... Indices>
+struct MakeIndexSequence<0, Indices...> : IndexSequence<Indices...> { };
+
 /**
  * A special function building class that is useful when funcall is evaluating
  * arguments and it shouldn't be.
+ *
+ * A builder can be reused for several invocations of the same function by
+ * calling rewind() before adding the next set of arguments. The argument
+ * expressions allocated by the previous invocation are then rebound in place
+ * instead of being allocated again.
  */
 class FunctionBuilder
 {
 public:
     FunctionBuilder(Environment* env);
+    /// Construct a builder which targets the given prepared function
+    FunctionBuilder(Environment* env, const FunctionHandle& handle);
     ~FunctionBuilder();
     void setFunctionReference(const std::string& func);
+    /**
+     * Use an already resolved function reference instead of looking it up by
+     * name.
+     * @param handle the handle obtained from Environment::prepareFunction
+     * @throw Problem the handle is stale
+     */
+    void setFunctionReference(const FunctionHandle& handle);
     /**
      * raw interface to CLIPS, you must call the corresponding CLIPS functions
      * yourself.
@@ -109,6 +614,13 @@ public:
      */
     void installArgument(uint16_t type, void* value);
     void installArgument(DataObjectType type, void* value);
+
+    /**
+     * Start building the argument list from the beginning again while keeping
+     * the already allocated argument expressions around for reuse. Any
+     * expressions which are not rebound before the next invoke are released.
+     */
+    void rewind();
     /**
      * Install the given string as an argument to the given expression
      * @param chars the chars to make an expression out of
@@ -127,6 +639,9 @@ public:
 
     void addArgument(double value);
 
+    /// Install the pre-registered symbol as a symbol argument
+    void addArgument(SymbolId value);
+
     template<typename T>
     void addArgument(T* value);
     /**
@@ -158,57 +673,129 @@ public:
         }
     }
 
-    template<typename First, typename ... Args>
-    void addArgument(First f, Args ... values)
+    /**
+     * Flatten the contents of the std::tuple by adding individual elements
+     * @param tuple the tuple which has the contents to add to the expression
+     */
+    template<typename ... Args>
+    void addArgument(const std::tuple<Args...>& tuple)
     {
-        addArgument(f);
-        addArgument(values...);
+        addTupleArguments(tuple, MakeIndexSequence<sizeof...(Args)>());
     }
 
+    /**
+     * Add each of the given arguments in order. The arguments are forwarded
+     * so nothing is copied on the way down to the single argument overloads.
+     * At least two arguments are required so that this never competes with
+     * the single argument overloads.
+     */
+    template<typename First, typename Second, typename ... Rest>
+    void addArgument(First&& f, Second&& s, Rest&& ... rest)
+    {
+        addArgument(std::forward<First>(f));
+        addArgument(std::forward<Second>(s), std::forward<Rest>(rest)...);
+    }
+
+    /// Evaluate the built expression
+    /// @throw Problem the evaluation resulted in an error
     void invoke(DataObjectPtr ret);
 
-    void addArgument(std::function<void(FunctionBuilder*)> fn);
+    /// Evaluate the built expression without throwing on evaluation errors
+    /// @return true if the evaluation succeeded
+    bool tryInvoke(DataObjectPtr ret);
+
+    /// Evaluate the built expression without throwing at all, the call text
+    /// can be had from describeFailure until the builder is rebound
+    /// @return CallError::None if the evaluation succeeded
+    CallError invoke(DataObjectPtr ret, std::nothrow_t);
+
+    /// @return a human readable description of the failed invocation
+    std::string describeFailure() const;
+
+    void addArgument(const std::function<void(FunctionBuilder*)>& fn);
+
+    template<typename T>
+    void addArgument(const Symbol<T>& value);
+
+    template<typename T>
+    void addArgument(const InstanceName<T>& value);
+
+    template<typename T>
+    void addArgument(const ExternalAddress<T>& value)
+    {
+        addArgument(value.value);
+    }
+
+    template<typename I>
+    void addArgument(const Range<I>& range)
+    {
+        for (I it = range.begin; it != range.end; ++it) {
+            addArgument(*it);
+        }
+    }
 
     /**
-     * Return a function which operates on a begin and end iterator.
+     * Pass every element between begin and end as a separate argument.
      */
     template<typename I>
-    static std::function<void(FunctionBuilder*)> collection(I begin, I end)
+    static Range<I> collection(I begin, I end)
     {
-        return [begin, end](FunctionBuilder* fb) {
-            for (I it = begin; it != end; ++it) {
-                fb->addArgument(*it);
-            }
-        };
+        return Range<I> { begin, end };
     }
 
     /**
-     * Return a function which operates on a container.
+     * Pass every element of the given container as a separate argument, the
+     * container must outlive the returned range.
      */
-    template<typename I>
-    static std::function<void(FunctionBuilder*)> collection(const I& i)
+    template<typename C>
+    static auto collection(const C& container) -> Range<decltype(std::begin(container))>
     {
-        return [&i](FunctionBuilder* fb) {
-            for (auto it : i) {
-                fb->addArgument(it);
-            }
-        };
+        return Range<decltype(std::begin(container))> { std::begin(container), std::end(container) };
     }
 
     /**
-     * Mark the given thing as a symbol by capturing it and returning it as a
-     * std::function.
-     * @param thingToConvertToSymbol The thing that we want to convert into a * symbol
-     * @return a std::function which loads the given thing into the function * builder
+     * Mark the given thing as a symbol. Nothing is allocated, the tag is resolved
+     * by addArgument at compile time.
+     * @param thingToConvertToSymbol The thing that we want to convert into a symbol
+     * @return a tag which loads the given thing into the function builder as a symbol
      */
     template<typename T>
-    static std::function<void(FunctionBuilder*)> symbol(T thingToConvertToSymbol);
+    static Symbol<T> symbol(T&& thingToConvertToSymbol)
+    {
+        return Symbol<T> { std::forward<T>(thingToConvertToSymbol) };
+    }
 
+    /**
+     * Mark the given thing as an instance name.
+     * @param thingToConvertToInstanceName The thing that we want to pass as an instance name
+     * @return a tag which loads the given thing into the function builder as an instance name
+     */
     template<typename T>
-    static std::function<void(FunctionBuilder*)> externalAddress(T* thingToWrapAsExternalAddress);
+    static InstanceName<T> instanceName(T&& thingToConvertToInstanceName)
+    {
+        return InstanceName<T> { std::forward<T>(thingToConvertToInstanceName) };
+    }
 
+    template<typename T>
+    static ExternalAddress<T> externalAddress(T* thingToWrapAsExternalAddress)
+    {
+        return ExternalAddress<T> { thingToWrapAsExternalAddress };
+    }
+
+private:
+    friend class Environment;
+    /// @return the name of the target function as known by CLIPS
+    std::string getFunctionName() const;
+    /// release the argument expressions which were not rebound since the last rewind
+    void releaseUnboundArguments();
+
+    template<typename Tuple, size_t ... Indices>
+    void addTupleArguments(const Tuple& tuple, IndexSequence<Indices...>)
+    {
+        using expander = int[];
+        (void)expander { 0, (addArgument(std::get<Indices>(tuple)), 0)... };
+    }
 private:
-    std::string _function;
     Environment* env;
     FUNCTION_REFERENCE _ref;
     EXPRESSION* curr = nullptr;
@@ -224,9 +811,59 @@ class MultifieldBuilder
     public:
         explicit MultifieldBuilder(void* rawMultifield) : _rawMultifield(rawMultifield) { }
         MultifieldBuilder(Environment* env, int32_t size);
+
+        /**
+         * Construct a multifield holding every element between begin and end.
+         * The multifield is sized once and filled in a single pass, the CLIPS
+         * type of each element is chosen by injectData at compile time.
+         */
+        template<typename I>
+        MultifieldBuilder(Environment* env, I begin, I end);
+
+        template<typename I>
+        static MultifieldBuilder fromRange(Environment* env, I begin, I end)
+        {
+            return MultifieldBuilder(env, begin, end);
+        }
+
+        template<typename C>
+        static MultifieldBuilder fromRange(Environment* env, const C& container)
+        {
+            return MultifieldBuilder(env, std::begin(container), std::end(container));
+        }
+
+        /**
+         * Construct a multifield from the given range and wrap it in a data
+         * object which covers the whole multifield.
+         */
+        template<typename I>
+        static DataObject makeDataObject(Environment* env, I begin, I end)
+        {
+            return MultifieldBuilder(env, begin, end).toDataObject();
+        }
+
+        template<typename C>
+        static DataObject makeDataObject(Environment* env, const C& container)
+        {
+            return makeDataObject(env, std::begin(container), std::end(container));
+        }
+
         void* getRawMultifield() const { return _rawMultifield; }
+        int32_t size() const;
         void setField(DataObjectType type, int index, void* value);
+
+        /**
+         * Set the given field to a C++ value converted through injectData.
+         * @throw Problem the builder was constructed from a raw multifield
+         */
+        template<typename T>
+        void setField(int index, const T& value);
+
+        /// @return a data object whose begin and end cover the whole multifield
+        DataObject toDataObject() const;
+        void toDataObject(DataObjectPtr ret) const;
     private:
+        Environment* _env = nullptr;
         void* _rawMultifield;
 };
 template<typename T>
@@ -235,13 +872,398 @@ struct ExternalAddressCache
     public:
         ExternalAddressCache() = delete;
         ~ExternalAddressCache() = delete;
+        /// @throw Problem T was never registered with the given environment
         static int getExternalAddressId(Environment* env);
         static void registerExternalAddressId(Environment* env, int result);
+};
+/**
+ * A defclass which has been looked up once by name.
+ */
+class DefclassHandle : public ConstructHandle
+{
+public:
+    DefclassHandle() = default;
+    void* getRawDefclass() const { return _defclass; }
+private:
+    friend class Environment;
+    DefclassHandle(Environment* env, const std::string& name, void* defclass, uint64_t generation) : ConstructHandle(env, name, generation), _defclass(defclass) { }
+    void* _defclass = nullptr;
+};
+
+/**
+ * A slot of a defclass which has been resolved once so that the slots of its
+ * instances can be accessed without looking up the slot name. Instances of
+ * other classes (such as subclasses) are still supported but go through the
+ * slower lookup by symbol.
+ */
+class SlotHandle : public ConstructHandle
+{
+public:
+    SlotHandle() = default;
+    void* getRawDefclass() const { return _defclass; }
+private:
+    friend class Environment;
+    friend class InstanceBuilder;
+    SlotHandle(Environment* env, const std::string& name, void* defclass, void* slotName, int index, uint64_t generation) : ConstructHandle(env, name, generation), _defclass(defclass), _slotName(slotName), _index(index) { }
+    void* _defclass = nullptr;
+    /// the interned name of the slot
+    void* _slotName = nullptr;
+    /// index of the slot within the instances of the defclass
+    int _index = -1;
+};
+
+/// One fact or instance produced by a query along with its selected slots
+struct QueryResult
+{
+    void* address = nullptr;
+    /// the values of the selected slots, in the order they were selected
+    std::vector<DataObject> values;
+};
+
+/**
+ * How a Query walks working memory, specialized for facts (FactSlotHandle)
+ * and instances (SlotHandle).
+ */
+template<typename SlotType>
+struct QuerySource;
+
+template<>
+struct QuerySource<FactSlotHandle>
+{
+    /// @return the fact of the given deftemplate after current, or the first one when current is nullptr
+    static void* next(Environment* env, void* deftemplate, void* current);
+    static void project(Environment* env, void* fact, const FactSlotHandle& slot, DataObjectPtr ret);
+};
+
+template<>
+struct QuerySource<SlotHandle>
+{
+    /// @return the direct instance of the given defclass after current, or the first one when current is nullptr
+    static void* next(Environment* env, void* defclass, void* current);
+    static void project(Environment* env, void* instance, const SlotHandle& slot, DataObjectPtr ret);
+};
+
+/**
+ * Lazily walks the facts of a deftemplate or the instances of a defclass
+ * straight out of working memory, without building a multifield first.
+ * Results can be filtered with a predicate and the slots of interest are
+ * copied into the result as it is produced. Asserting, retracting or
+ * deleting while a query is being iterated invalidates its iterators.
+ */
+template<typename SlotType>
+class Query
+{
+public:
+    using Predicate = std::function<bool(const QueryResult&)>;
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = QueryResult;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const QueryResult*;
+        using reference = const QueryResult&;
+
+        iterator() = default;
+        /// all iterators of a query share a single result which is overwritten on every step
+        const QueryResult& operator*() const { return _query->_result; }
+        const QueryResult* operator->() const { return &_query->_result; }
+        iterator& operator++() { advance(); return *this; }
+        bool operator==(const iterator& other) const { return _query == other._query && _current == other._current; }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
     private:
-        static int getExternalAddressId(void* env);
-        static void registerExternalAddressId(void* env, int result);
-        static std::map<void*, int> _cache;
+        friend class Query;
+        explicit iterator(Query* query) : _query(query) { advance(); }
+        void advance();
+        Query* _query = nullptr;
+        size_t _container = 0;
+        void* _current = nullptr;
+    };
+public:
+    Query(Environment* env, std::vector<void*> containers) : _env(env), _containers(std::move(containers)) { }
+
+    /// Only produce results the predicate accepts, it sees the selected slots
+    Query& where(Predicate predicate) & { _predicate = std::move(predicate); return *this; }
+    Query where(Predicate predicate) && { _predicate = std::move(predicate); return std::move(*this); }
+
+    /// Copy the given slots into QueryResult::values for every result
+    Query& select(std::vector<SlotType> slots) & { setSlots(std::move(slots)); return *this; }
+    Query select(std::vector<SlotType> slots) && { setSlots(std::move(slots)); return std::move(*this); }
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+private:
+    void setSlots(std::vector<SlotType> slots)
+    {
+        _slots = std::move(slots);
+        _result.values.resize(_slots.size());
+    }
+private:
+    Environment* _env;
+    std::vector<void*> _containers;
+    std::vector<SlotType> _slots;
+    Predicate _predicate;
+    QueryResult _result;
+};
+
+template<typename SlotType>
+void
+Query<SlotType>::iterator::advance()
+{
+    auto& containers = _query->_containers;
+    while (_container < containers.size()) {
+        _current = QuerySource<SlotType>::next(_query->_env, containers[_container], _current);
+        if (!_current) {
+            ++_container;
+            continue;
+        }
+        auto& result = _query->_result;
+        result.address = _current;
+        for (size_t i = 0; i < _query->_slots.size(); ++i) {
+            QuerySource<SlotType>::project(_query->_env, _current, _query->_slots[i], &result.values[i]);
+        }
+        if (!_query->_predicate || _query->_predicate(result)) {
+            return;
+        }
+    }
+    // exhausted, compare equal to end()
+    _query = nullptr;
+    _container = 0;
+    _current = nullptr;
+}
+
+using FactQuery = Query<FactSlotHandle>;
+using InstanceQuery = Query<SlotHandle>;
+
+/**
+ * Builds facts of a single deftemplate by writing the slots directly through
+ * pre-resolved slot handles and asserting them, without formatting or parsing
+ * any text along the way. The builder can be reused, after each assertion it
+ * starts on a fresh fact.
+ */
+class FactBuilder
+{
+public:
+    /// @throw Problem the deftemplate handle is stale
+    FactBuilder(Environment* env, const DeftemplateHandle& deftemplate);
+    /// the fact being built is owned by exactly one builder
+    FactBuilder(const FactBuilder&) = delete;
+    FactBuilder& operator=(const FactBuilder&) = delete;
+    ~FactBuilder();
+
+    /**
+     * Set a slot of the fact being built.
+     * @param slot the slot to set, it must belong to the deftemplate of this builder
+     * @param value the value to store in the slot
+     * @throw Problem the slot does not belong to this deftemplate or the value does not fit the slot
+     */
+    FactBuilder& set(const FactSlotHandle& slot, DataObjectPtr value);
+
+    /// Set a slot of the fact being built to a C++ value converted through injectData
+    template<typename T>
+    FactBuilder& set(const FactSlotHandle& slot, const T& value);
+
+    /**
+     * Fill in the defaults of the slots which were not set and assert the fact.
+     * @return the asserted fact
+     * @throw Problem a slot without a default was not set or the assertion failed
+     */
+    void* assertFact();
+private:
+    void* getFact();
+private:
+    Environment* _env;
+    void* _deftemplate;
+    void* _fact = nullptr;
 };
+
+/**
+ * Builds instances of a single defclass without going through the
+ * make-instance parser. The make-instance call is assembled directly as an
+ * expression so instance creation still sends init and honours slot
+ * overrides and default values exactly like the command does. The builder
+ * can be reused to make any number of instances.
+ */
+class InstanceBuilder
+{
+public:
+    /// @throw Problem the defclass handle is stale
+    InstanceBuilder(Environment* env, const DefclassHandle& defclass);
+    ~InstanceBuilder();
+
+    /// Name the next instance, without a name a unique one is generated
+    InstanceBuilder& setName(const std::string& name);
+
+    /**
+     * Override a slot of the next instance.
+     * @param slot the slot to set, it must belong to the defclass of this builder
+     * @param value the value to store in the slot, multifields are stored field by field
+     * @throw Problem the slot does not belong to this defclass
+     */
+    InstanceBuilder& set(const SlotHandle& slot, DataObjectPtr value);
+
+    /// Override a slot of the next instance with a C++ value converted through injectData
+    template<typename T>
+    InstanceBuilder& set(const SlotHandle& slot, const T& value);
+
+    /**
+     * Make the instance with the name and slot overrides given so far and then
+     * forget them so the builder can be used for the next instance.
+     * @return the new instance
+     * @throw Problem the instance could not be made
+     */
+    void* makeInstance();
+private:
+    void releaseOverrides();
+private:
+    Environment* _env;
+    void* _defclass;
+    std::string _className;
+    /// the make-instance call, its arguments are the name, the class and then the slot overrides
+    FUNCTION_REFERENCE _ref;
+    /// the gensym* call used when no name was given
+    FUNCTION_REFERENCE _gensym;
+    /// the value list of the last slot override
+    EXPRESSION* _lastOverride = nullptr;
+};
+
+/// What Environment::restore had to change to bring working memory back to a snapshot
+struct RestoreStatistics
+{
+    size_t factsRetracted = 0;
+    size_t factsAsserted = 0;
+    size_t instancesDeleted = 0;
+    size_t instancesMade = 0;
+    /// slots of surviving instances which were put back to their old value
+    size_t slotsRestored = 0;
+    size_t globalsRestored = 0;
+    /// how long the restore took
+    std::chrono::nanoseconds elapsed{0};
+};
+
+/**
+ * The facts, instances and defglobal values of an environment as they were
+ * when Environment::snapshot was called, usually right after a reset. The
+ * snapshot holds references into its environment so it must not outlive it.
+ * Once the environment is cleared or constructs are loaded it is stale and
+ * gives those references back right away.
+ */
+class WorkingMemorySnapshot
+{
+public:
+    WorkingMemorySnapshot() = default;
+    WorkingMemorySnapshot(WorkingMemorySnapshot&& other);
+    WorkingMemorySnapshot& operator=(WorkingMemorySnapshot&& other);
+    WorkingMemorySnapshot(const WorkingMemorySnapshot&) = delete;
+    WorkingMemorySnapshot& operator=(const WorkingMemorySnapshot&) = delete;
+    ~WorkingMemorySnapshot();
+
+    size_t factCount() const { return _facts.size(); }
+    size_t instanceCount() const { return _instances.size(); }
+    /// @return true if the constructs of the environment changed since the snapshot was taken
+    bool isStale() const;
+    explicit operator bool() const { return _env != nullptr; }
+private:
+    friend class Environment;
+    struct ClassImage
+    {
+        DefclassHandle defclass;
+        std::vector<SlotHandle> slots;
+        /// whether make-instance may override the slot when the instance is made again
+        std::vector<bool> initable;
+    };
+    struct InstanceImage
+    {
+        std::string name;
+        size_t classIndex;
+        /// one installed value per slot of the class
+        std::vector<DataObject> values;
+    };
+    struct GlobalImage
+    {
+        void* defglobal;
+        DataObject value;
+    };
+    /// register the snapshot with the given environment so it is released once it becomes stale
+    void attach(Environment* env);
+    /// take over the registration and contents of the given snapshot
+    void takeFrom(WorkingMemorySnapshot& other);
+    /// give back every reference the snapshot holds
+    void release();
+private:
+    Environment* _env = nullptr;
+    uint64_t _generation = 0;
+    /// the facts of the snapshot, each one installed so its contents survive a retraction
+    std::vector<void*> _facts;
+    std::unordered_set<void*> _factSet;
+    std::vector<ClassImage> _classes;
+    std::vector<InstanceImage> _instances;
+    std::unordered_map<std::string, size_t> _instancesByName;
+    std::vector<GlobalImage> _globals;
+};
+
+/**
+ * Tags a path as a binary image written by Environment::saveImage so that an
+ * Environment can be constructed from it.
+ */
+struct BinaryImage
+{
+    explicit BinaryImage(const std::string& p) : path(p) { }
+    std::string path;
+};
+
+/// A picture of the memory CLIPS is holding on to for an environment
+struct MemoryStatistics
+{
+    /// bytes CLIPS currently has allocated, including its free lists
+    int64_t bytesInUse = 0;
+    /// allocations CLIPS has made and not yet given back
+    int64_t outstandingRequests = 0;
+    /// entries of the symbol table
+    size_t symbols = 0;
+    /// symbols which are no longer referenced and wait to be garbage collected
+    size_t ephemeralSymbols = 0;
+    /// integers and floats which wait to be garbage collected
+    size_t ephemeralNumbers = 0;
+};
+
+/// How a bounded run of the rule engine ended
+struct RunResult
+{
+    /// the number of rules which fired
+    int64_t rulesFired = 0;
+    /// no module on the focus stack had activations left when the run returned
+    bool agendaDrained = false;
+    /// the run was stopped because its budget ran out (or its predicate said so)
+    bool budgetExpired = false;
+};
+
+/// What Environment::invokeBatch should do when a row fails to evaluate
+enum class BatchErrorPolicy {
+    /// throw a Problem describing the first failure
+    Throw,
+    /// record the first failure and stop processing rows
+    Stop,
+    /// record every failure and keep going
+    Collect,
+};
+
+/// A single failed row of a batched invocation
+struct BatchError
+{
+    size_t row;
+    std::string message;
+};
+
+/// The outcome of a batched invocation
+struct BatchResult
+{
+    /// the number of rows which were evaluated (successfully or not)
+    size_t processed;
+    std::vector<BatchError> errors;
+};
+
 /// Wrapper class to handle the use of a clips environment
 class Environment
 {
@@ -277,19 +1299,126 @@ public:
     /// Construct a temporary wrapper over an already existing environment
     Environment(void* env);
 
+    /**
+     * Construct a new environment from a binary image instead of parsing the constructs.
+     * @param image the image written earlier by saveImage
+     * @param prepare invoked before the image is loaded, the user functions
+     * and external address types the constructs refer to must be installed here
+     * @throw Problem the image could not be loaded
+     */
+    Environment(const BinaryImage& image, const std::function<void(Environment&)>& prepare = nullptr);
+
     /// Reclaims the memory of a given electron environment
     virtual ~Environment();
 
     /// Calls the reset function within CLIPS
     void reset();
 
+    /// Capture the facts, instances and defglobal values currently in working
+    /// memory, usually right after a reset, so that restore can return to them
+    WorkingMemorySnapshot snapshot();
+
+    /**
+     * Bring working memory back to the given snapshot by undoing only what
+     * changed since it was taken: facts which are gone are asserted again,
+     * new facts and instances are removed, changed slots and defglobals are
+     * put back, and the activations which already fired are refreshed onto
+     * the agenda. The focus and current module are set to MAIN first, like
+     * reset does. Unlike reset, fact indices keep counting up, and auto-focus
+     * rules whose activations survived untouched do not push their module
+     * again. Instances which are made again keep the defaults of their
+     * read-only and shared slots.
+     * @param snapshot a snapshot taken from this environment, facts asserted again replace the old ones in it
+     * @return what had to be changed and how long it took
+     * @throw Problem the snapshot belongs to another environment or is stale
+     */
+    RestoreStatistics restore(WorkingMemorySnapshot& snapshot);
+
+    /// Calls the clear function within CLIPS, this invalidates all outstanding handles
+    void clear();
+
     /// Runs the given CLIPS environment (rule execution)
     /// @return The number of rules fired
     int64_t run(int64_t count = -1L);
 
-    /// Loads the given source file into the given clips environment
+    /**
+     * Run the rule engine until the agenda is empty or the given amount of
+     * time has passed. The deadline is checked between rule firings, so a
+     * single long running rule can still overshoot it.
+     * @param budget how long the rules may run
+     * @param count the maximum number of rules to fire, -1 for no limit
+     */
+    RunResult runFor(std::chrono::nanoseconds budget, int64_t count = -1L);
+
+    /**
+     * Run the rule engine until the agenda is empty or the given predicate,
+     * which is asked after every rule firing, returns true.
+     * @param count the maximum number of rules to fire, -1 for no limit
+     * @throw anything the predicate throws, once the engine has stopped
+     */
+    RunResult runUntil(const std::function<bool()>& stop, int64_t count = -1L);
+
+    /// @return how much memory CLIPS holds for this environment, this walks
+    /// the symbol tables so it is meant for monitoring and not for hot paths
+    MemoryStatistics memoryStats() const;
+
+    /**
+     * Garbage collect the atoms nothing refers to anymore and hand the memory
+     * kept on the CLIPS free lists back to the system. Values returned
+     * earlier which were not installed may be reclaimed by this.
+     * @return the number of bytes released
+     */
+    int64_t compact();
+
+    /// Compact the environment only if it holds more than the given number of bytes
+    /// @return the number of bytes released
+    int64_t releaseMemory(int64_t threshold);
+
+    /// Start or stop recording how often and for how long each rule fires and
+    /// each function invoked through a FunctionBuilder runs. This is cheap
+    /// enough to leave on under load, unlike watch.
+    void enableProfiling(bool enable = true);
+
+    /// @return whether rule firings and function invocations are being recorded
+    bool isProfiling() const;
+
+    /// @return the rules and functions recorded so far
+    ProfileSnapshot profile() const;
+
+    /// Forget everything recorded so far, profiling stays enabled if it was
+    void resetProfile();
+
+    /// Loads the given source file into the given clips environment, this invalidates all outstanding handles
     void loadFile(const std::string& path);
 
+    /**
+     * Load constructs straight out of the given buffer, the parser reads the
+     * buffer in place through a string router so nothing is copied. This
+     * invalidates all outstanding handles.
+     * @param data the constructs text, it does not have to be null terminated
+     * @param len the number of characters in data
+     * @param name reported as the file being parsed while the buffer is
+     * loaded, the same way loadFile reports the path
+     * @throw Problem the constructs could not be parsed
+     */
+    void loadFromBuffer(const char* data, size_t len, const std::string& name = "buffer");
+
+    /// Load the given source file by mapping it into memory (mmap on POSIX,
+    /// MapViewOfFile on Windows) and parsing it in place instead of reading it
+    /// through stdio, this invalidates all outstanding handles
+    /// @throw Problem the file could not be mapped or parsed
+    void loadMappedFile(const std::string& path);
+
+    /// Write the constructs of this environment to a binary image (bsave)
+    /// @throw Problem the image could not be written
+    void saveImage(const std::string& path);
+
+    /// Replace the constructs of this environment with the ones stored in the
+    /// given binary image (bload), this invalidates all outstanding handles.
+    /// Every user function the image refers to must already be installed.
+    /// @throw Problem the image could not be loaded
+    void loadImage(const std::string& path);
+
     /// Return the raw environment pointer, USE ONLY IN CASES WHERE FUNCTIONALITY IS MISSING IN THIS CLASS
     void* getRawEnvironment();
 
@@ -303,6 +1432,17 @@ public:
     /// @throw Problem calling the given function with the specified args resulted in a runtime error
     void funcall(const std::string& functionName, const std::string& args, DataObjectPtr obj);
 
+    /// Call a function inside an electron environment without throwing when it fails, nothing
+    /// is formatted on failure; describeFuncall builds the message if it is wanted after all
+    /// @param functionName the name of the function to be invoked
+    /// @param args a string containing space deliminated arguments to be passed to the given function
+    /// @param obj the struct which will contain the result of the funcall
+    /// @return CallError::None on success
+    CallError funcall(const std::string& functionName, const std::string& args, DataObjectPtr obj, std::nothrow_t);
+
+    /// @return the human readable description of a failed funcall
+    static std::string describeFuncall(const std::string& functionName, const std::string& args);
+
     /// Call a function inside an electron environment but the result is not important
     /// @param functionName the name of the function to be invoked
     /// @param args The argument list as a constant string
@@ -361,6 +1501,42 @@ public:
     /// convert const char* to a symbol in the CLIPS symbol table
     void* addSymbol(const char* symbol);
 
+    /// @return the symbol registered under the given id
+    void* addSymbol(SymbolId symbol);
+
+    /// Intern the given string once and keep it alive for the lifetime of the
+    /// environment so that it can be passed around by id afterwards
+    /// @return the id to use in place of the string
+    SymbolId registerSymbol(const std::string& symbol);
+
+    /// Enable or disable caching of the symbols interned by addSymbol. Cached
+    /// symbols are locked in the CLIPS symbol table until the cache is cleared.
+    /// @param enable whether addSymbol should consult the cache
+    /// @param maximumEntries the number of distinct strings to cache, strings beyond that go straight to CLIPS
+    void enableSymbolCache(bool enable = true, size_t maximumEntries = 4096);
+
+    /// Release all symbols held by the symbol cache (registered symbols are kept)
+    void clearSymbolCache();
+
+    /// @return the hit and miss counters of the symbol cache
+    SymbolCacheStatistics getSymbolCacheStatistics() const;
+
+    /**
+     * Enable or disable recycling of the expression nodes FunctionBuilder and
+     * InstanceBuilder build their calls from. Released nodes are kept on a
+     * per environment free list and handed out again instead of going
+     * through the CLIPS allocator for every argument.
+     * @param enable whether released nodes should be pooled
+     * @param maximumNodes the number of nodes to keep, nodes beyond that go straight back to CLIPS
+     */
+    void enableExpressionPool(bool enable = true, size_t maximumNodes = 1024);
+
+    /// Hand every node waiting in the expression pool back to CLIPS
+    void trimExpressionPool();
+
+    /// @return the recycling counters of the expression pool
+    ExpressionPoolStatistics getExpressionPoolStatistics() const;
+
     /// Registers the given number into the CLIPS symbol table
     /// @return pointer to the registered symbol
     void* addNumber(int32_t number);
@@ -393,6 +1569,16 @@ public:
     /// @throw Problem instance construction error
     void* makeInstance(const std::string& instanceString);
 
+    /**
+     * Make one instance of the given defclass per element of the given range
+     * through a single reused InstanceBuilder.
+     * @param fill called as fill(InstanceBuilder&, element) to name the instance and set its slots
+     * @return the number of instances made
+     * @throw Problem an instance could not be made
+     */
+    template<typename I, typename F>
+    size_t makeInstances(const DefclassHandle& defclass, I begin, I end, F fill);
+
     /// Delete an instance
     /// @param instancePtr the instance to delete
     void unmakeInstance(void* instancePtr);
@@ -406,12 +1592,69 @@ public:
     /// @param ret the data_object pointer to store the result in
     void getSlot(void* instance, const std::string& slotName, DataObjectPtr ret);
 
+    /// Look up the given defclass once so its slots can be resolved
+    /// @throw Problem the defclass does not exist
+    DefclassHandle findDefclass(const std::string& name);
+
+    /// Resolve the given slot of a defclass once so it can be accessed without a name lookup
+    /// @throw Problem the defclass does not have a slot of the given name
+    SlotHandle findSlot(const DefclassHandle& defclass, const std::string& slotName);
+
+    /// Set the slot of a given instance through a pre-resolved slot handle
+    /// @throw Problem the slot could not be set
+    void setSlot(void* instance, const SlotHandle& slot, DataObjectPtr data);
+
+    /// Get the value stored in the given instance's slot through a pre-resolved slot handle
+    /// @param instance the instance pointer
+    /// @param slot the slot to access
+    /// @param ret the data_object pointer to store the result in
+    /// @throw Problem the instance has been deleted or does not have the slot
+    void getSlot(void* instance, const SlotHandle& slot, DataObjectPtr ret);
+
+    /// Get the values of several slots of the given instance in one call
+    /// @param instance the instance pointer
+    /// @param slots the slots to access
+    /// @param ret an array of at least slots.size() data objects which receive the slot values in order
+    /// @throw Problem the instance has been deleted or does not have one of the slots
+    void getSlots(void* instance, const std::vector<SlotHandle>& slots, DataObjectPtr ret);
+
+    /// Get the value of a slot of the given fact through a pre-resolved slot handle
+    /// @throw Problem the handle is stale or belongs to another deftemplate
+    void getFactSlot(void* fact, const FactSlotHandle& slot, DataObjectPtr ret);
+
+    /// Retract the given fact
+    /// @throw Problem the fact could not be retracted
+    void retractFact(void* fact);
+
+    /// Keep CLIPS from reclaiming the memory of the given fact until
+    /// releaseFact is called, even if it is retracted in the meantime
+    void retainFact(void* fact);
+
+    /// Undo a previous retainFact
+    void releaseFact(void* fact);
+
+    /// @return whether the given (retained) fact is still in working memory
+    bool factExists(void* fact);
+
+    /// Walk the facts of the given deftemplate, see Query
+    FactQuery facts(const DeftemplateHandle& deftemplate);
+
+    /// Walk the instances of the given defclass, see Query
+    /// @param includeSubclasses also walk the instances of every subclass, like find-all-instances
+    InstanceQuery instances(const DefclassHandle& defclass, bool includeSubclasses = true);
+
     /// install an expression into the environment (memory management)
     void installExpression(EXPRESSION* expr);
 
     /// uninstall the given expression from the environment (memory management)
     void deinstallExpression(EXPRESSION* expr);
 
+    /// increment the reference count of the given atomic value (memory management)
+    void installAtom(uint16_t type, void* value);
+
+    /// decrement the reference count of the given atomic value (memory management)
+    void deinstallAtom(uint16_t type, void* value);
+
     /// evaluate the given expression
     bool evaluateExpression(EXPRESSION* expr, DataObjectPtr ret);
 
@@ -424,57 +1667,181 @@ public:
     /// find the function associated with the given name
     bool generateFunctionExpression(const std::string& name, FUNCTION_REFERENCE* ref);
 
+    /// Look up the given function once so that it can be invoked repeatedly
+    /// without paying for the name lookup each time
+    /// @param name the name of the function to resolve
+    /// @return a handle which stays valid until the environment is cleared or reloaded
+    /// @throw Problem the function does not exist
+    FunctionHandle prepareFunction(const std::string& name);
+
+    /// @return a counter which changes whenever cached construct pointers may have become stale
+    uint64_t getConstructGeneration() const;
+
+    /// Mark every handle and cached function reference of this environment as
+    /// stale, needed after constructs were redefined or removed behind the
+    /// wrapper's back (from a rule, eval or a batch file)
+    void invalidateConstructHandles();
+
+    /// Look up the given deftemplate once so facts can be built from it repeatedly
+    /// @throw Problem the deftemplate does not exist
+    DeftemplateHandle findDeftemplate(const std::string& name);
+
+    /// Resolve the position of a slot within the given deftemplate
+    /// @throw Problem the deftemplate has no such slot or is an ordered (implied) deftemplate
+    FactSlotHandle findFactSlot(const DeftemplateHandle& deftemplate, const std::string& slotName);
+
+    /// Assert one fact per element between begin and end
+    /// @param deftemplate the deftemplate of the facts to assert
+    /// @param fill called as fill(FactBuilder&, element) to set the slots of each fact
+    /// @return the number of facts asserted
+    /// @throw Problem an assertion failed
+    template<typename I, typename F>
+    size_t assertFacts(const DeftemplateHandle& deftemplate, I begin, I end, F fill);
+
     void buildAndExecuteFunction(const std::string& function);
     void buildAndExecuteFunction(const std::string& function, DataObjectPtr ret);
     template<typename T0>
-    void buildAndExecuteFunction(const std::string& function, DataObjectPtr ret, T0 arg0)
+    void buildAndExecuteFunction(const std::string& function, DataObjectPtr ret, T0&& arg0)
+    {
+        FunctionBuilder fb(this);
+        fb.setFunctionReference(function);
+        fb.addArgument(std::forward<T0>(arg0));
+        fb.invoke(ret);
+    }
+    template<typename T0, typename T1>
+    void buildAndExecuteFunction(const std::string& function, DataObjectPtr ret, T0&& arg0, T1&& arg1)
     {
         FunctionBuilder fb(this);
         fb.setFunctionReference(function);
-        fb.addArgument(arg0);
+        fb.addArgument(std::forward<T0>(arg0));
+        fb.addArgument(std::forward<T1>(arg1));
         fb.invoke(ret);
     }
-    template<typename T0, typename T1>
-    void buildAndExecuteFunction(const std::string& function, DataObjectPtr ret, T0 arg0, T1 arg1)
+
+    /// Build a function expression and then execute it
+    /// @param function the name of the function to execute
+    /// @param ret The DataObject pointer to store the result in
+    /// @param args The variadic list of arguments useful for execution, these are forwarded and never copied
+    template<typename ... Args>
+    void buildAndExecuteFunction(const std::string& function, DataObjectPtr ret, Args&& ... args)
+    {
+        FunctionBuilder fb(this);
+        fb.setFunctionReference(function);
+        fb.addArgument(std::forward<Args>(args)...);
+        fb.invoke(ret);
+    }
+
+    /// Build a function expression, execute it, and convert the results
+    /// @param function the name of the function to execute
+    /// @param ret The data object to store the result in
+    /// @param args The variadic list of arguments useful for execution, these are forwarded and never copied
+    template<typename R, typename ... Args>
+    void buildAndExecuteFunction(const std::string& function, R& ret, Args&& ... args)
+    {
+        DataObject r;
+        buildAndExecuteFunction(function, &r, std::forward<Args>(args)...);
+        extractValue(&r, ret);
+    }
+    template<typename ... Args>
+    void buildAndExecuteFunction(const std::string& function, std::function<void(Environment*, DataObjectPtr)> ret, Args&& ... args)
     {
-        FunctionBuilder fb(this);
-        fb.setFunctionReference(function);
-        fb.addArgument(arg0);
-        fb.addArgument(arg1);
-        fb.invoke(ret);
+        DataObject r;
+        buildAndExecuteFunction(function, &r, std::forward<Args>(args)...);
+        ret(this, &r);
     }
 
-    /// Build a function expression and then execute it
-    /// @param function the name of the function to execute
+    void buildAndExecuteFunction(const FunctionHandle& function);
+    void buildAndExecuteFunction(const FunctionHandle& function, DataObjectPtr ret);
+
+    /// Build a function expression from a prepared handle and then execute it
+    /// @param function the handle of the function to execute
     /// @param ret The DataObject pointer to store the result in
     /// @param args The variadic list of arguments useful for execution
+    /// @throw Problem the handle is stale or the invocation failed
     template<typename ... Args>
-    void buildAndExecuteFunction(const std::string& function, DataObjectPtr ret, Args ... args)
+    void buildAndExecuteFunction(const FunctionHandle& function, DataObjectPtr ret, Args&& ... args)
     {
-        FunctionBuilder fb(this);
-        fb.setFunctionReference(function);
-        fb.addArgument(args...);
+        FunctionBuilder fb(this, function);
+        fb.addArgument(std::forward<Args>(args)...);
         fb.invoke(ret);
     }
 
-    /// Build a function expression, execute it, and convert the results
-    /// @param function the name of the function to execute
+    /// Build a function expression from a prepared handle, execute it, and convert the results
+    /// @param function the handle of the function to execute
     /// @param ret The data object to store the result in
     /// @param args The variadic list of arguments useful for execution
     template<typename R, typename ... Args>
-    void buildAndExecuteFunction(const std::string& function, R& ret, Args ... args)
+    void buildAndExecuteFunction(const FunctionHandle& function, R& ret, Args&& ... args)
     {
         DataObject r;
-        buildAndExecuteFunction(function, &r, args...);
+        buildAndExecuteFunction(function, &r, std::forward<Args>(args)...);
         extractValue(&r, ret);
     }
-    template<typename ... Args>
-    void buildAndExecuteFunction(const std::string& function, std::function<void(Environment*, DataObjectPtr)> ret, Args ... args)
+
+    /**
+     * Call a function declared at compile time through
+     * NEUTRON_DECLARE_FUNCTION. The function is looked up the first time it
+     * is called in this environment and again only once construct handles
+     * become stale (see ConstructHandle), the arguments are bound into a
+     * fixed array of expressions on the stack.
+     * @param ret The DataObject pointer to store the result in
+     * @param args the arguments, converted through ArgumentTraits
+     * @throw Problem the function does not exist or the invocation failed
+     */
+    template<typename Tag, typename ... Args>
+    void call(DataObjectPtr ret, Args&& ... args);
+
+    /// Call a function declared at compile time and convert the result
+    /// @param ret The data object to store the result in
+    /// @param args the arguments, converted through ArgumentTraits
+    template<typename Tag, typename R, typename ... Args>
+    void call(R& ret, Args&& ... args)
     {
         DataObject r;
-        buildAndExecuteFunction(function, &r, args...);
-        ret(this, &r);
+        call<Tag>(&r, std::forward<Args>(args)...);
+        extractValue(&r, ret);
+    }
+
+    /// Invoke the given function once per row, reusing a single argument
+    /// expression chain for the whole batch
+    /// @param function the handle of the function to execute
+    /// @param rows the arguments for each invocation
+    /// @param results iterator over preallocated storage which receives the extracted result of each row, it is advanced for failed rows as well
+    /// @param policy what to do when a row fails
+    /// @return the number of processed rows and the errors that were recorded
+    /// @throw Problem a row failed and the policy is BatchErrorPolicy::Throw
+    template<typename OutputIt, typename ... Args>
+    BatchResult invokeBatch(const FunctionHandle& function, const std::vector<std::tuple<Args...>>& rows, OutputIt results, BatchErrorPolicy policy = BatchErrorPolicy::Throw)
+    {
+        BatchResult outcome { 0, std::vector<BatchError>() };
+        FunctionBuilder fb(this, function);
+        DataObject r;
+        for (auto const& row : rows) {
+            fb.rewind();
+            fb.addArgument(row);
+            if (fb.tryInvoke(&r)) {
+                extractValue(&r, *results);
+            } else if (policy == BatchErrorPolicy::Throw) {
+                auto tmp = fb.describeFailure();
+                clearEvaluationError();
+                throw Problem(tmp);
+            } else {
+                outcome.errors.emplace_back(BatchError { outcome.processed, fb.describeFailure() });
+                clearEvaluationError();
+                if (policy == BatchErrorPolicy::Stop) {
+                    ++outcome.processed;
+                    break;
+                }
+            }
+            ++results;
+            ++outcome.processed;
+        }
+        return outcome;
     }
+
+    /// Reset the evaluation error and halt flags so that evaluation can continue after a failure
+    void clearEvaluationError();
+
     /// Extract data out of the given data object using the provided function
     /// @param dobj the data object to extract data from
     /// @param fn the function which will convert the given data object to data
@@ -520,6 +1887,20 @@ public:
 
     bool installUserFunction(const std::string& name, UserFunctionReturnType returnType, RawFunction body, const std::string& actualName, const char* restrictions);
 
+    /**
+     * Define a user function whose arguments are decoded straight into the
+     * parameters of body. The restriction string is generated from the
+     * signature at compile time, so CLIPS checks the argument count and types
+     * before body is called and body never has to.
+     * @tparam Signature the C++ signature of body, such as int64_t(int64_t, StringView)
+     * @param name the name of the function within CLIPS
+     * @param body the callable to invoke, a Problem (or any std::exception)
+     * thrown from it is reported as an evaluation error
+     * @return whether CLIPS accepted the definition
+     */
+    template<typename Signature, typename F>
+    bool defineFunction(const std::string& name, F body);
+
     /**
      * Build a new raw mutlfield to operate on!
      * @param size the size of the multifield to construct
@@ -563,9 +1944,43 @@ protected:
     // For testing
     Environment(int) : env(nullptr) {};
 
+private:
+    /// find or allocate the shared bookkeeping of the given raw environment
+    static EnvironmentState* attachState(void* theEnv);
+    /// bump the construct generation and release the snapshots which just became stale
+    static void invalidateConstructs(void* theEnv);
+    /// invalidate the construct handles if the given funcall may have changed a construct
+    void noteConstructChange(const std::string& functionName);
+    /// invoked by CLIPS before a (clear) so that no snapshot keeps constructs busy
+    static int releaseSnapshots(void* theEnv);
+    /// intern the given string through the symbol cache
+    void* addCachedSymbol(const char* symbol, size_t length);
+    /// @return the slot of the given instance the handle refers to
+    void* resolveSlot(void* instance, const SlotHandle& slot);
+    /// the restore steps for each kind of working memory element
+    void restoreFacts(WorkingMemorySnapshot& snapshot, RestoreStatistics& result);
+    void restoreInstances(WorkingMemorySnapshot& snapshot, RestoreStatistics& result);
+    void restoreGlobals(WorkingMemorySnapshot& snapshot, RestoreStatistics& result);
+    friend class WorkingMemorySnapshot;
+    template<typename T>
+    friend struct ExternalAddressCache;
+    friend class FunctionBuilder;
+    /// take ownership of the given binding and define its user function with it as the context
+    bool defineBoundFunction(std::unique_ptr<UserFunctionBinding> binding, int returnType, RawFunction body, const char* restrictions);
+    /// record a single invocation of the function a builder calls
+    void recordInvocation(const FunctionBuilder& builder, std::chrono::nanoseconds elapsed);
+    /// record a single invocation of a function called through call
+    void recordInvocation(void* function, const char* name, std::chrono::nanoseconds elapsed);
+    /// @return the reference of the declared function with the given tag id, resolved if needed
+    /// @throw Problem no function with the given name exists
+    FUNCTION_REFERENCE resolveBoundFunction(size_t id, const char* name);
+    /// install the arguments of the given call, evaluate it and deinstall them again
+    /// @throw Problem the invocation failed
+    void invokeBoundFunction(FUNCTION_REFERENCE* call, const char* name, DataObjectPtr ret);
 private:
     bool reclaim = false;
     void* env;
+    EnvironmentState* state = nullptr;
 };
 
 /// Extract a multifield of strings out of a given DataObject and place its contents inside a std::list
@@ -578,6 +1993,47 @@ void extractData(Environment* env, DataObjectPtr dobj, std::list<std::string>& l
 /// @param list A pointer to a std::vector<string> to store the multifield contents in
 void extractData(Environment* env, DataObjectPtr dobj, std::vector<std::string>& list);
 
+/// Point a MultifieldView at the multifield stored in a DataObject, nothing is copied
+/// @param dobj The data object containing the multifield
+/// @param view the view to update
+void extractData(Environment* env, DataObjectPtr dobj, MultifieldView& view);
+
+/// Append the contents of a multifield of integers to a std::vector
+/// @param dobj The data object to extract the multifield contents from
+/// @param list the vector to append the integers to
+/// @throw Problem the multifield contains something other than integers
+void extractData(Environment* env, DataObjectPtr dobj, std::vector<int64_t>& list);
+
+/// Append the contents of a multifield of numbers to a std::vector
+/// @param dobj The data object to extract the multifield contents from
+/// @param list the vector to append the numbers to
+/// @throw Problem the multifield contains something other than numbers
+void extractData(Environment* env, DataObjectPtr dobj, std::vector<double>& list);
+
+/// Append the contents of a multifield of numbers to a std::vector
+/// @param dobj The data object to extract the multifield contents from
+/// @param list the vector to append the numbers to
+/// @throw Problem the multifield contains something other than numbers
+void extractData(Environment* env, DataObjectPtr dobj, std::vector<float>& list);
+
+/// Copy the contents of a multifield of integers into caller owned memory
+/// @param dobj The data object to extract the multifield contents from
+/// @param buffer the memory to write to, its length is updated to the number of integers written
+/// @throw Problem the multifield contains something other than integers or does not fit
+void extractData(Environment* env, DataObjectPtr dobj, MultifieldBuffer<int64_t>& buffer);
+
+/// Copy the contents of a multifield of numbers into caller owned memory
+/// @param dobj The data object to extract the multifield contents from
+/// @param buffer the memory to write to, its length is updated to the number of values written
+/// @throw Problem the multifield contains something other than numbers or does not fit
+void extractData(Environment* env, DataObjectPtr dobj, MultifieldBuffer<double>& buffer);
+
+/// Copy the contents of a multifield of numbers into caller owned memory
+/// @param dobj The data object to extract the multifield contents from
+/// @param buffer the memory to write to, its length is updated to the number of values written
+/// @throw Problem the multifield contains something other than numbers or does not fit
+void extractData(Environment* env, DataObjectPtr dobj, MultifieldBuffer<float>& buffer);
+
 /// Extract the int32_t value out of a DataObject and place it in a provided field
 /// @param dobj The data object to extract the int32_t value from
 /// @param value a reference to an int32_t value to be updated
@@ -623,64 +2079,518 @@ void extractData(Environment* env, DataObjectPtr dobj, bool& value);
 /// @param value a reference to an string stream value to be updated
 void extractData(Environment* env, DataObjectPtr dobj, std::stringstream& value);
 
+/// Convert a C++ value into a CLIPS value, this is the inverse of extractData
+/// and uses the same conventions as FunctionBuilder::addArgument
+/// @param ret The data object to store the converted value in
+/// @param value the value to convert
+void injectData(Environment* env, DataObjectPtr ret, int32_t value);
+void injectData(Environment* env, DataObjectPtr ret, int64_t value);
+void injectData(Environment* env, DataObjectPtr ret, uint32_t value);
+void injectData(Environment* env, DataObjectPtr ret, float value);
+void injectData(Environment* env, DataObjectPtr ret, double value);
+void injectData(Environment* env, DataObjectPtr ret, bool value);
+/// strings are converted to the CLIPS STRING type
+void injectData(Environment* env, DataObjectPtr ret, const char* value);
+void injectData(Environment* env, DataObjectPtr ret, const std::string& value);
+void injectData(Environment* env, DataObjectPtr ret, SymbolId value);
+void injectData(Environment* env, DataObjectPtr ret, const MultifieldBuilder& value);
+void injectData(Environment* env, DataObjectPtr ret, const DataObject& value);
+
+/// the remaining integer types (uint64_t, size_t, long long, ...) become CLIPS
+/// integers as well, unsigned values above INT64_MAX wrap around
 template<typename T>
-std::function<void(FunctionBuilder*)>
-FunctionBuilder::symbol(T convertToSymbol)
+typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type
+injectData(Environment* env, DataObjectPtr ret, T value)
 {
-    return [&convertToSymbol](FunctionBuilder* fb) {
-        fb->installArgument(SYMBOL, (void*)fb->env->addSymbol(convertToSymbol));
-    };
+    injectData(env, ret, static_cast<int64_t>(value));
 }
 
 template<typename T>
-std::function<void(FunctionBuilder*)>
-FunctionBuilder::externalAddress(T* thingToWrapAsExternalAddress)
+void
+injectData(Environment* env, DataObjectPtr ret, const Symbol<T>& value)
 {
-    return [thingToWrapAsExternalAddress](FunctionBuilder* fb) {
-        fb->installArgument(thingToWrapAsExternalAddress);
-    };
+    SetDataObjectType(ret, DataObjectType::Symbol);
+    SetDataObjectValue(ret, env->addSymbol(value.value));
 }
 
 template<typename T>
 void
-FunctionBuilder::addArgument(T* externalAddress) {
-    installArgument(DataObjectType::ExternalAddress, env->addExternalAddress<T>(externalAddress));
+injectData(Environment* env, DataObjectPtr ret, const InstanceName<T>& value)
+{
+    SetDataObjectType(ret, DataObjectType::InstanceName);
+    SetDataObjectValue(ret, env->addSymbol(value.value));
 }
 
 template<typename T>
-std::map<void*, int> ExternalAddressCache<T>::_cache;
+void
+injectData(Environment* env, DataObjectPtr ret, T* value)
+{
+    SetDataObjectType(ret, DataObjectType::ExternalAddress);
+    SetDataObjectValue(ret, env->addExternalAddress<T>(value));
+}
 
 template<typename T>
-int
-ExternalAddressCache<T>::getExternalAddressId(void* env)
+void
+injectData(Environment* env, DataObjectPtr ret, const ExternalAddress<T>& value)
 {
-    auto found = _cache.find(env);
-    if (found != _cache.end()) {
-        return found->second;
-    } else {
-        throw Problem("Attempted to get the external address index of something not registered from using an unregistered environment!");
+    injectData(env, ret, value.value);
+}
+
+/**
+ * Declare a tag for a function which is known at compile time so that it can
+ * be invoked through Environment::call without looking it up by name:
+ *
+ *     NEUTRON_DECLARE_FUNCTION(ScoreOrder, "score-order");
+ *     env.call<ScoreOrder>(score, Neutron::FunctionBuilder::externalAddress(&order));
+ */
+#define NEUTRON_DECLARE_FUNCTION(tag, functionName) \
+    struct tag { static const char* name() { return functionName; } }
+
+/// The CLIPS type an argument of Environment::call is passed as, fixed at compile time
+template<uint16_t Type>
+struct FixedArgumentType
+{
+    static constexpr uint16_t type = Type;
+};
+
+/**
+ * Maps the decayed type of an argument of Environment::call to the atom it
+ * is passed as. Types without a specialization go through injectData, so
+ * every type an injectData overload exists for can be passed.
+ */
+template<typename T, typename Enable = void>
+struct ArgumentTraits
+{
+    static void install(Environment* env, EXPRESSION& node, const T& value)
+    {
+        DataObject tmp;
+        injectData(env, &tmp, value);
+        node.type = static_cast<uint16_t>(GetType(tmp));
+        node.value = GetValue(tmp);
+    }
+};
+
+template<typename T>
+struct ArgumentTraits<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> : FixedArgumentType<INTEGER>
+{
+    static void install(Environment* env, EXPRESSION& node, T value)
+    {
+        node.type = type;
+        node.value = env->addNumber(static_cast<int64_t>(value));
+    }
+};
+
+template<typename T>
+struct ArgumentTraits<T, typename std::enable_if<std::is_floating_point<T>::value>::type> : FixedArgumentType<FLOAT>
+{
+    static void install(Environment* env, EXPRESSION& node, T value)
+    {
+        node.type = type;
+        node.value = env->addNumber(static_cast<double>(value));
+    }
+};
+
+template<>
+struct ArgumentTraits<bool> : FixedArgumentType<SYMBOL>
+{
+    static void install(Environment* env, EXPRESSION& node, bool value)
+    {
+        node.type = type;
+        node.value = value ? ::EnvTrueSymbol(env->getRawEnvironment()) : ::EnvFalseSymbol(env->getRawEnvironment());
+    }
+};
+
+template<>
+struct ArgumentTraits<std::string> : FixedArgumentType<STRING>
+{
+    static void install(Environment* env, EXPRESSION& node, const std::string& value)
+    {
+        node.type = type;
+        node.value = env->addSymbol(value);
+    }
+};
+
+template<>
+struct ArgumentTraits<const char*> : FixedArgumentType<STRING>
+{
+    static void install(Environment* env, EXPRESSION& node, const char* value)
+    {
+        node.type = type;
+        node.value = env->addSymbol(value);
+    }
+};
+
+template<>
+struct ArgumentTraits<char*> : ArgumentTraits<const char*> { };
+
+template<>
+struct ArgumentTraits<SymbolId> : FixedArgumentType<SYMBOL>
+{
+    static void install(Environment* env, EXPRESSION& node, SymbolId value)
+    {
+        node.type = type;
+        node.value = env->addSymbol(value);
+    }
+};
+
+template<typename T>
+struct ArgumentTraits<Symbol<T>> : FixedArgumentType<SYMBOL>
+{
+    static void install(Environment* env, EXPRESSION& node, const Symbol<T>& value)
+    {
+        node.type = type;
+        node.value = env->addSymbol(value.value);
+    }
+};
+
+template<typename T>
+struct ArgumentTraits<InstanceName<T>> : FixedArgumentType<INSTANCE_NAME>
+{
+    static void install(Environment* env, EXPRESSION& node, const InstanceName<T>& value)
+    {
+        node.type = type;
+        node.value = env->addSymbol(value.value);
+    }
+};
+
+template<typename T>
+struct ArgumentTraits<T*> : FixedArgumentType<EXTERNAL_ADDRESS>
+{
+    static void install(Environment* env, EXPRESSION& node, T* value)
+    {
+        node.type = type;
+        node.value = env->addExternalAddress<T>(value);
+    }
+};
+
+template<typename T>
+struct ArgumentTraits<ExternalAddress<T>> : FixedArgumentType<EXTERNAL_ADDRESS>
+{
+    static void install(Environment* env, EXPRESSION& node, const ExternalAddress<T>& value)
+    {
+        node.type = type;
+        node.value = env->addExternalAddress<T>(value.value);
+    }
+};
+
+template<typename Tag, typename ... Args>
+void
+Environment::call(DataObjectPtr ret, Args&& ... args)
+{
+    auto ref = resolveBoundFunction(TypeId<Tag>::value(), Tag::name());
+    std::array<EXPRESSION, sizeof...(Args)> nodes;
+    size_t index = 0;
+    using expander = int[];
+    (void)expander { 0, (ArgumentTraits<typename std::decay<Args>::type>::install(this, nodes[index++], args), 0)... };
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        nodes[i].argList = nullptr;
+        nodes[i].nextArg = i + 1 < nodes.size() ? &nodes[i + 1] : nullptr;
+    }
+    ref.argList = nodes.empty() ? nullptr : nodes.data();
+    invokeBoundFunction(&ref, Tag::name(), ret);
+}
+
+template<typename I>
+MultifieldBuilder::MultifieldBuilder(Environment* env, I begin, I end) : MultifieldBuilder(env, static_cast<int32_t>(std::distance(begin, end)))
+{
+    int index = 1;
+    for (I it = begin; it != end; ++it, ++index) {
+        setField(index, *it);
     }
 }
 
 template<typename T>
-int
-ExternalAddressCache<T>::getExternalAddressId(Environment* env)
+void
+MultifieldBuilder::setField(int index, const T& value)
+{
+    if (!_env) {
+        throw Problem("Attempted to convert a C++ value into a multifield field without an environment!");
+    }
+    DataObject tmp;
+    injectData(_env, &tmp, value);
+    setField(static_cast<DataObjectType>(GetType(tmp)), index, GetValue(tmp));
+}
+
+template<typename T>
+FactBuilder&
+FactBuilder::set(const FactSlotHandle& slot, const T& value)
+{
+    DataObject tmp;
+    injectData(_env, &tmp, value);
+    return set(slot, &tmp);
+}
+
+template<typename T>
+InstanceBuilder&
+InstanceBuilder::set(const SlotHandle& slot, const T& value)
+{
+    DataObject tmp;
+    injectData(_env, &tmp, value);
+    return set(slot, &tmp);
+}
+
+template<typename I, typename F>
+size_t
+Environment::makeInstances(const DefclassHandle& defclass, I begin, I end, F fill)
+{
+    InstanceBuilder ib(this, defclass);
+    size_t count = 0;
+    for (I it = begin; it != end; ++it, ++count) {
+        fill(ib, *it);
+        ib.makeInstance();
+    }
+    return count;
+}
+
+template<typename I, typename F>
+size_t
+Environment::assertFacts(const DeftemplateHandle& deftemplate, I begin, I end, F fill)
+{
+    FactBuilder fb(this, deftemplate);
+    size_t count = 0;
+    for (I it = begin; it != end; ++it, ++count) {
+        fill(fb, *it);
+        fb.assertFact();
+    }
+    return count;
+}
+
+template<typename T>
+void
+FunctionBuilder::addArgument(const Symbol<T>& value)
+{
+    installArgument(DataObjectType::Symbol, env->addSymbol(value.value));
+}
+
+template<typename T>
+void
+FunctionBuilder::addArgument(const InstanceName<T>& value)
 {
-    return getExternalAddressId(env->getRawEnvironment());
+    installArgument(DataObjectType::InstanceName, env->addSymbol(value.value));
 }
 
 template<typename T>
 void
-ExternalAddressCache<T>::registerExternalAddressId(void* env, int result)
+FunctionBuilder::addArgument(T* externalAddress) {
+    installArgument(DataObjectType::ExternalAddress, env->addExternalAddress<T>(externalAddress));
+}
+
+template<typename T>
+int
+ExternalAddressCache<T>::getExternalAddressId(Environment* env)
 {
-    _cache.emplace(env, result);
+    auto const& ids = env->state->externalAddressIds;
+    auto index = TypeId<T>::value();
+    if (index < ids.size() && ids[index] >= 0) {
+        return ids[index];
+    } else {
+        throw Problem("Attempted to get the external address index of something not registered from using an unregistered environment!");
+    }
 }
 
 template<typename T>
 void
 ExternalAddressCache<T>::registerExternalAddressId(Environment* env, int result)
 {
-    registerExternalAddressId(env->getRawEnvironment(), result);
+    auto& ids = env->state->externalAddressIds;
+    auto index = TypeId<T>::value();
+    if (index >= ids.size()) {
+        ids.resize(index + 1, -1);
+    }
+    ids[index] = result;
+}
+
+/**
+ * Describes how a C++ parameter type of a function defined through
+ * Environment::defineFunction is passed by CLIPS: restriction is the type code
+ * used in the restriction string and decode converts the already type
+ * checked argument. Specialize this to support additional parameter types.
+ */
+template<typename T, typename Enable = void>
+struct ValueTraits;
+
+template<typename T>
+struct ValueTraits<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+{
+    static constexpr char restriction = 'i';
+    static T decode(Environment*, DataObjectPtr value) { return static_cast<T>(DOPToLong(value)); }
+};
+
+template<typename T>
+struct ValueTraits<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+{
+    static constexpr char restriction = 'n';
+    /// integers are accepted as well, DOPToDouble converts them
+    static T decode(Environment*, DataObjectPtr value) { return static_cast<T>(DOPToDouble(value)); }
+};
+
+template<>
+struct ValueTraits<bool>
+{
+    static constexpr char restriction = 'w';
+    static bool decode(Environment* env, DataObjectPtr value) { return GetpValue(value) != ::EnvFalseSymbol(env->getRawEnvironment()); }
+};
+
+template<>
+struct ValueTraits<std::string>
+{
+    static constexpr char restriction = 'k';
+    static std::string decode(Environment*, DataObjectPtr value) { return DOPToString(value); }
+};
+
+/// borrows the characters of the symbol or string, nothing is copied
+template<>
+struct ValueTraits<StringView>
+{
+    static constexpr char restriction = 'k';
+    static StringView decode(Environment*, DataObjectPtr value) { return StringView(DOPToString(value)); }
+};
+
+template<>
+struct ValueTraits<const char*>
+{
+    static constexpr char restriction = 'k';
+    static const char* decode(Environment*, DataObjectPtr value) { return DOPToString(value); }
+};
+
+template<>
+struct ValueTraits<MultifieldView>
+{
+    static constexpr char restriction = 'm';
+    static MultifieldView decode(Environment*, DataObjectPtr value) { return MultifieldView(value); }
+};
+
+template<>
+struct ValueTraits<DataObject>
+{
+    static constexpr char restriction = 'u';
+    static DataObject decode(Environment*, DataObjectPtr value) { return *value; }
+};
+
+/// external addresses are checked against the type registered for T
+template<typename T>
+struct ValueTraits<T*, typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value>::type>
+{
+    static constexpr char restriction = 'a';
+    static T* decode(Environment* env, DataObjectPtr value) { return env->fromExternalAddress<T>(value); }
+};
+
+/// The restriction string of a function taking Args, computed at compile time
+template<typename ... Args>
+struct RestrictionString
+{
+    static_assert(sizeof...(Args) <= 9, "CLIPS restriction strings only support up to nine arguments");
+    static const char value[sizeof...(Args) + 4];
+};
+
+template<typename ... Args>
+const char RestrictionString<Args...>::value[sizeof...(Args) + 4] = {
+    static_cast<char>('0' + sizeof...(Args)),
+    static_cast<char>('0' + sizeof...(Args)),
+    'u',
+    ValueTraits<typename std::decay<Args>::type>::restriction...,
+    '\0'
+};
+
+/// report that the body of a user function threw, it must not unwind through CLIPS
+void reportUserFunctionFailure(void* theEnv, const std::string& function, const char* what);
+
+template<typename F, typename R, typename ... Args>
+struct TypedUserFunction : UserFunctionBinding
+{
+    TypedUserFunction(const std::string& name, F&& b) : UserFunctionBinding(name), body(std::move(b)) { }
+
+    template<size_t ... Indices>
+    R call(Environment& env, IndexSequence<Indices...>)
+    {
+        // one slot per argument (and one more so that it is never empty)
+        DataObject args[sizeof...(Args) + 1];
+        (void)args;
+        // the elements of a braced initializer are evaluated in order, the
+        // arguments of a function call are not
+        std::tuple<typename std::decay<Args>::type...> decoded { ValueTraits<typename std::decay<Args>::type>::decode(&env, ::EnvRtnUnknown(env.getRawEnvironment(), Indices + 1, &args[Indices]))... };
+        (void)decoded;
+        return body(std::get<Indices>(decoded)...);
+    }
+
+    static void invoke(void* theEnv, DataObjectPtr ret)
+    {
+        auto self = static_cast<TypedUserFunction*>(::GetEnvironmentFunctionContext(theEnv));
+        Environment env(theEnv);
+        try {
+            injectData(&env, ret, self->call(env, MakeIndexSequence<sizeof...(Args)>()));
+        } catch (std::exception& e) {
+            reportUserFunctionFailure(theEnv, self->name, e.what());
+            injectData(&env, ret, false);
+        } catch (...) {
+            reportUserFunctionFailure(theEnv, self->name, "unknown exception");
+            injectData(&env, ret, false);
+        }
+    }
+
+    F body;
+};
+
+template<typename F, typename ... Args>
+struct TypedUserFunction<F, void, Args...> : UserFunctionBinding
+{
+    TypedUserFunction(const std::string& name, F&& b) : UserFunctionBinding(name), body(std::move(b)) { }
+
+    template<size_t ... Indices>
+    void call(Environment& env, IndexSequence<Indices...>)
+    {
+        DataObject args[sizeof...(Args) + 1];
+        (void)args;
+        std::tuple<typename std::decay<Args>::type...> decoded { ValueTraits<typename std::decay<Args>::type>::decode(&env, ::EnvRtnUnknown(env.getRawEnvironment(), Indices + 1, &args[Indices]))... };
+        (void)decoded;
+        body(std::get<Indices>(decoded)...);
+    }
+
+    static void invoke(void* theEnv)
+    {
+        auto self = static_cast<TypedUserFunction*>(::GetEnvironmentFunctionContext(theEnv));
+        Environment env(theEnv);
+        try {
+            self->call(env, MakeIndexSequence<sizeof...(Args)>());
+        } catch (std::exception& e) {
+            reportUserFunctionFailure(theEnv, self->name, e.what());
+        } catch (...) {
+            reportUserFunctionFailure(theEnv, self->name, "unknown exception");
+        }
+    }
+
+    F body;
+};
+
+template<typename Signature>
+struct UserFunctionDefinition;
+
+template<typename R, typename ... Args>
+struct UserFunctionDefinition<R(Args...)>
+{
+    static int returnType()
+    {
+        return static_cast<int>(std::is_void<R>::value ? Environment::UserFunctionReturnType::Void : Environment::UserFunctionReturnType::Any);
+    }
+
+    static const char* restrictions() { return RestrictionString<Args...>::value; }
+
+    template<typename F>
+    static Environment::RawFunction entry() { return (Environment::RawFunction)TypedUserFunction<F, R, Args...>::invoke; }
+
+    template<typename F>
+    static std::unique_ptr<UserFunctionBinding> bind(const std::string& name, F&& body)
+    {
+        return std::unique_ptr<UserFunctionBinding>(new TypedUserFunction<F, R, Args...>(name, std::move(body)));
+    }
+};
+
+template<typename Signature, typename F>
+bool
+Environment::defineFunction(const std::string& name, F body)
+{
+    using Definition = UserFunctionDefinition<Signature>;
+    return defineBoundFunction(Definition::bind(name, std::move(body)), Definition::returnType(), Definition::template entry<F>(), Definition::restrictions());
 }
 
 } // namespace Neutron
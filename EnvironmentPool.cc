@@ -0,0 +1,269 @@
+/*
+ *
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+#include "EnvironmentPool.h"
+
+namespace Neutron
+{
+
+// Begin Lease stuff
+EnvironmentPool::Lease::Lease(Lease&& other) : _pool(other._pool), _index(other._index)
+{
+    other._pool = nullptr;
+}
+
+EnvironmentPool::Lease&
+EnvironmentPool::Lease::operator=(Lease&& other)
+{
+    if (this != &other) {
+        release();
+        _pool = other._pool;
+        _index = other._index;
+        other._pool = nullptr;
+    }
+    return *this;
+}
+
+EnvironmentPool::Lease::~Lease()
+{
+    release();
+}
+
+Environment*
+EnvironmentPool::Lease::get() const
+{
+    if (!_pool) {
+        throw Problem("Attempted to use an environment lease which is not checked out!");
+    }
+    return _pool->_environments[_index].get();
+}
+
+void
+EnvironmentPool::Lease::release()
+{
+    if (_pool) {
+        _pool->checkin(_index);
+        _pool = nullptr;
+    }
+}
+// end Lease stuff
+
+EnvironmentPool::EnvironmentPool(size_t size, const std::vector<std::string>& files, Initializer init)
+{
+    populate(size, [&files, &init]() {
+                std::unique_ptr<Environment> env(new Environment());
+                // the constructs in the files may call the functions init registers
+                if (init) {
+                    init(*env);
+                }
+                for (auto const& file : files) {
+                    env->loadFile(file);
+                }
+                return env;
+            });
+}
+
+EnvironmentPool::EnvironmentPool(const BinaryImage& image, size_t size, Initializer init)
+{
+    populate(size, [&image, &init]() {
+                return std::unique_ptr<Environment>(new Environment(image, init));
+            });
+}
+
+void
+EnvironmentPool::populate(size_t size, const std::function<std::unique_ptr<Environment>()>& create)
+{
+    if (size == 0) {
+        throw Problem("An environment pool needs at least one environment!");
+    }
+    _environments.reserve(size);
+    _free.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        _environments.emplace_back(create());
+        _free.emplace_back(i);
+    }
+    _stats.useCounts.resize(size, 0);
+    _snapshots.resize(size);
+}
+
+EnvironmentPool::~EnvironmentPool()
+{
+    // wait for outstanding leases instead of pulling environments out from
+    // under the threads still using them
+    std::unique_lock<std::mutex> guard(_lock);
+    _returned.wait(guard, [this]() { return _free.size() == _environments.size(); });
+}
+
+EnvironmentPool::Lease
+EnvironmentPool::acquire(Clock::time_point start, size_t index)
+{
+    // reset outside of the lock, nobody else can touch this environment
+    Lease lease(this, index);
+    auto& env = *_environments[index];
+    auto& snapshot = _snapshots[index];
+    auto resetStart = Clock::now();
+    bool restored = false;
+    if (!_useSnapshots) {
+        snapshot = WorkingMemorySnapshot();
+        env.reset();
+    } else if (snapshot && !snapshot.isStale()) {
+        try {
+            env.restore(snapshot);
+        } catch (...) {
+            // the next checkout starts over from a reset
+            snapshot = WorkingMemorySnapshot();
+            throw;
+        }
+        restored = true;
+    } else {
+        env.reset();
+        snapshot = env.snapshot();
+    }
+    auto now = Clock::now();
+    auto resetTime = std::chrono::duration_cast<std::chrono::nanoseconds>(now - resetStart);
+    auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start);
+    std::lock_guard<std::mutex> guard(_lock);
+    if (restored) {
+        ++_stats.restores;
+        _stats.totalRestoreTime += resetTime;
+    } else {
+        ++_stats.resets;
+        _stats.totalResetTime += resetTime;
+    }
+    _stats.totalCheckoutLatency += latency;
+    if (latency > _stats.maxCheckoutLatency) {
+        _stats.maxCheckoutLatency = latency;
+    }
+    return lease;
+}
+
+EnvironmentPool::Lease
+EnvironmentPool::checkout()
+{
+    auto start = Clock::now();
+    size_t index = 0;
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        if (_free.empty()) {
+            ++_stats.exhaustions;
+            _returned.wait(guard, [this]() { return !_free.empty(); });
+        }
+        index = _free.back();
+        _free.pop_back();
+        ++_stats.checkouts;
+        ++_stats.useCounts[index];
+    }
+    return acquire(start, index);
+}
+
+EnvironmentPool::Lease
+EnvironmentPool::checkout(std::chrono::milliseconds timeout)
+{
+    auto start = Clock::now();
+    size_t index = 0;
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        if (_free.empty()) {
+            ++_stats.exhaustions;
+            if (!_returned.wait_for(guard, timeout, [this]() { return !_free.empty(); })) {
+                ++_stats.timeouts;
+                std::stringstream ss;
+                ss << "No environment became available within " << timeout.count() << "ms!";
+                auto str = ss.str();
+                throw Problem(str);
+            }
+        }
+        index = _free.back();
+        _free.pop_back();
+        ++_stats.checkouts;
+        ++_stats.useCounts[index];
+    }
+    return acquire(start, index);
+}
+
+void
+EnvironmentPool::checkin(size_t index)
+{
+    CheckinPolicy policy;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        policy = _checkinPolicy;
+    }
+    bool failed = false;
+    if (policy) {
+        // still owned by the returning thread, so no lock is needed for this
+        try {
+            policy(*_environments[index]);
+        } catch (...) {
+            failed = true;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (failed) {
+            ++_stats.policyFailures;
+        }
+        _free.emplace_back(index);
+    }
+    _returned.notify_all();
+}
+
+void
+EnvironmentPool::setCheckinPolicy(CheckinPolicy policy)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _checkinPolicy = std::move(policy);
+}
+
+EnvironmentPool::CheckinPolicy
+EnvironmentPool::releaseMemoryAbove(int64_t bytes)
+{
+    return [bytes](Environment& env) { env.releaseMemory(bytes); };
+}
+
+void
+EnvironmentPool::enableSnapshots(bool enable)
+{
+    _useSnapshots = enable;
+}
+
+size_t
+EnvironmentPool::size() const
+{
+    return _environments.size();
+}
+
+size_t
+EnvironmentPool::available() const
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _free.size();
+}
+
+EnvironmentPoolStatistics
+EnvironmentPool::getStatistics() const
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _stats;
+}
+
+} // namespace Neutron
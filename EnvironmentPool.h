@@ -0,0 +1,184 @@
+/**
+ * @file
+ * A pool of pre-loaded environments which can be handed out to request handlers
+ * @copyright
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+#ifndef __LibNeutron_EnvironmentPool_h__
+#define __LibNeutron_EnvironmentPool_h__
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Environment.h"
+
+namespace Neutron
+{
+
+/// Health metrics of an EnvironmentPool
+struct EnvironmentPoolStatistics
+{
+    /// number of successful checkouts
+    uint64_t checkouts = 0;
+    /// number of checkouts which found no environment available
+    uint64_t exhaustions = 0;
+    /// number of checkouts which gave up after their timeout expired
+    uint64_t timeouts = 0;
+    /// time spent waiting for and resetting environments over all checkouts
+    std::chrono::nanoseconds totalCheckoutLatency{0};
+    /// the longest a single checkout took
+    std::chrono::nanoseconds maxCheckoutLatency{0};
+    /// number of times the checkin policy threw
+    uint64_t policyFailures = 0;
+    /// number of checkouts which reset their environment and the time that took
+    uint64_t resets = 0;
+    std::chrono::nanoseconds totalResetTime{0};
+    /// number of checkouts which restored a snapshot instead and the time that took
+    uint64_t restores = 0;
+    std::chrono::nanoseconds totalRestoreTime{0};
+    /// number of times each environment of the pool was checked out
+    std::vector<uint64_t> useCounts;
+};
+
+/**
+ * Keeps a fixed number of environments which have their constructs loaded
+ * up front so request handlers only pay for a reset instead of parsing the
+ * constructs files every time. All members are safe to call from any number
+ * of threads, an environment itself is only ever used by the thread which
+ * has it checked out.
+ */
+class EnvironmentPool
+{
+public:
+    /// Called once for every environment before its files or image are loaded,
+    /// this is the place to register the external address types and user
+    /// functions the constructs refer to
+    using Initializer = std::function<void(Environment&)>;
+    /// Called on every environment returned to the pool before anyone else can check it out
+    using CheckinPolicy = std::function<void(Environment&)>;
+
+    /// @return a checkin policy which compacts environments holding more than the given number of bytes
+    static CheckinPolicy releaseMemoryAbove(int64_t bytes);
+
+    /**
+     * An environment which is checked out of the pool, it is returned to the
+     * pool when the lease is destroyed or released.
+     */
+    class Lease
+    {
+    public:
+        Lease() = default;
+        Lease(Lease&& other);
+        Lease& operator=(Lease&& other);
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease();
+
+        Environment& operator*() const { return *get(); }
+        Environment* operator->() const { return get(); }
+        Environment* get() const;
+        explicit operator bool() const { return _pool != nullptr; }
+
+        /// Return the environment to the pool ahead of time
+        void release();
+    private:
+        friend class EnvironmentPool;
+        Lease(EnvironmentPool* pool, size_t index) : _pool(pool), _index(index) { }
+        EnvironmentPool* _pool = nullptr;
+        size_t _index = 0;
+    };
+
+public:
+    /**
+     * Create and warm up the given number of environments.
+     * @param size the number of environments to keep
+     * @param files the constructs files to load into every environment, in order
+     * @param init invoked on every environment before its files are loaded so
+     * the user functions and external address types they need are in place
+     * @throw Problem one of the environments could not be set up
+     */
+    EnvironmentPool(size_t size, const std::vector<std::string>& files, Initializer init = nullptr);
+
+    /**
+     * Create the given number of environments from a binary image, which is
+     * much faster than parsing the constructs files. The image comes first so
+     * a braced list of files can never be mistaken for it.
+     * @param image the image written by Environment::saveImage
+     * @param size the number of environments to keep
+     * @param init invoked on every environment before the image is loaded so
+     * the user functions and external address types it needs are in place
+     * @throw Problem one of the environments could not be set up
+     */
+    EnvironmentPool(const BinaryImage& image, size_t size, Initializer init = nullptr);
+    EnvironmentPool(const EnvironmentPool&) = delete;
+    EnvironmentPool& operator=(const EnvironmentPool&) = delete;
+    /// Every lease must be released before the pool is destroyed
+    ~EnvironmentPool();
+
+    /// Check out an environment, waiting for one to become available. The
+    /// environment is reset before it is handed out.
+    Lease checkout();
+
+    /// Check out an environment but give up after the given amount of time
+    /// @throw Problem no environment became available in time
+    Lease checkout(std::chrono::milliseconds timeout);
+
+    /// Run the given policy on every environment when it is checked back in,
+    /// exceptions thrown by it are counted and otherwise ignored
+    void setCheckinPolicy(CheckinPolicy policy);
+
+    /// Instead of resetting environments on checkout, reset each one once,
+    /// snapshot it and restore that snapshot on later checkouts. See
+    /// Environment::restore for how this differs from a reset.
+    void enableSnapshots(bool enable = true);
+
+    /// @return the number of environments in the pool
+    size_t size() const;
+
+    /// @return the number of environments which are currently not checked out
+    size_t available() const;
+
+    EnvironmentPoolStatistics getStatistics() const;
+private:
+    using Clock = std::chrono::steady_clock;
+    void populate(size_t size, const std::function<std::unique_ptr<Environment>()>& create);
+    Lease acquire(Clock::time_point start, size_t index);
+    void checkin(size_t index);
+private:
+    std::vector<std::unique_ptr<Environment>> _environments;
+    /// declared after _environments so they are released first
+    std::vector<WorkingMemorySnapshot> _snapshots;
+    std::atomic<bool> _useSnapshots{false};
+    /// indices of the environments which are not checked out
+    std::vector<size_t> _free;
+    mutable std::mutex _lock;
+    std::condition_variable _returned;
+    EnvironmentPoolStatistics _stats;
+    CheckinPolicy _checkinPolicy;
+};
+
+} // namespace Neutron
+#endif // end __LibNeutron_EnvironmentPool_h__
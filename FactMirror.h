@@ -0,0 +1,185 @@
+/**
+ * @file
+ * Keeps the facts of a deftemplate in step with a C++ collection
+ * @copyright
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+#ifndef __LibNeutron_FactMirror_h__
+#define __LibNeutron_FactMirror_h__
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include "Environment.h"
+
+namespace Neutron
+{
+
+/// What a single FactMirror::sync changed in working memory
+struct FactMirrorSyncResult
+{
+    size_t asserted = 0;
+    size_t retracted = 0;
+    size_t modified = 0;
+    size_t unchanged = 0;
+};
+
+/**
+ * Mirrors a C++ collection into the facts of a single deftemplate. Every
+ * element is identified by a key and the fact asserted for it is remembered,
+ * so each sync only asserts the new elements, retracts the removed ones and
+ * replaces the changed ones. The Rete network then only does work for what
+ * actually changed instead of for the whole collection.
+ *
+ * T must be copyable and comparable with ==, a copy of every element is kept
+ * to find out whether it changed. Facts which were retracted behind the
+ * mirror's back (by a rule or a reset) are asserted again on the next sync.
+ */
+template<typename Key, typename T, typename Hash = std::hash<Key>>
+class FactMirror
+{
+public:
+    using KeyOf = std::function<Key(const T&)>;
+    /// sets the slots of the fact for an element
+    using Fill = std::function<void(FactBuilder&, const T&)>;
+
+    /// @throw Problem the deftemplate handle is stale
+    FactMirror(Environment& env, const DeftemplateHandle& deftemplate, KeyOf keyOf, Fill fill) :
+        _env(env), _builder(&env, deftemplate), _keyOf(std::move(keyOf)), _fill(std::move(fill)) { }
+    FactMirror(const FactMirror&) = delete;
+    FactMirror& operator=(const FactMirror&) = delete;
+    /// The mirrored facts are left in working memory
+    ~FactMirror()
+    {
+        for (auto& entry : _facts) {
+            _env.releaseFact(entry.second.fact);
+        }
+    }
+
+    /**
+     * Bring working memory in line with the given collection.
+     * @param begin the first element of the collection
+     * @param end one past the last element of the collection
+     * @throw Problem an assertion or retraction failed, the mirror stays consistent with what was done up to that point
+     */
+    template<typename I>
+    FactMirrorSyncResult sync(I begin, I end)
+    {
+        FactMirrorSyncResult result;
+        ++_epoch;
+        for (I it = begin; it != end; ++it) {
+            auto const& value = *it;
+            auto key = _keyOf(value);
+            auto found = _facts.find(key);
+            if (found == _facts.end()) {
+                auto fact = assertValue(value);
+                _facts.emplace(std::move(key), Entry { fact, value, _epoch });
+                ++result.asserted;
+                continue;
+            }
+            auto& entry = found->second;
+            entry.epoch = _epoch;
+            auto alive = _env.factExists(entry.fact);
+            if (alive && entry.value == value) {
+                ++result.unchanged;
+                continue;
+            }
+            // CLIPS implements modify as a retraction followed by an assertion as well
+            if (alive) {
+                _env.retractFact(entry.fact);
+            }
+            _env.releaseFact(entry.fact);
+            try {
+                entry.fact = assertValue(value);
+            } catch (...) {
+                // the old fact is gone and there is no new one to remember
+                _facts.erase(found);
+                throw;
+            }
+            entry.value = value;
+            ++result.modified;
+        }
+        for (auto it = _facts.begin(); it != _facts.end(); ) {
+            if (it->second.epoch == _epoch) {
+                ++it;
+                continue;
+            }
+            if (_env.factExists(it->second.fact)) {
+                _env.retractFact(it->second.fact);
+            }
+            _env.releaseFact(it->second.fact);
+            it = _facts.erase(it);
+            ++result.retracted;
+        }
+        return result;
+    }
+
+    template<typename Container>
+    FactMirrorSyncResult sync(const Container& container)
+    {
+        return sync(std::begin(container), std::end(container));
+    }
+
+    /// Retract every mirrored fact and forget about them
+    void clear()
+    {
+        for (auto& entry : _facts) {
+            if (_env.factExists(entry.second.fact)) {
+                _env.retractFact(entry.second.fact);
+            }
+            _env.releaseFact(entry.second.fact);
+        }
+        _facts.clear();
+    }
+
+    /// @return the fact mirroring the element with the given key or nullptr
+    void* find(const Key& key) const
+    {
+        auto found = _facts.find(key);
+        return found == _facts.end() ? nullptr : found->second.fact;
+    }
+
+    size_t size() const { return _facts.size(); }
+private:
+    struct Entry
+    {
+        void* fact;
+        T value;
+        uint64_t epoch;
+    };
+
+    void* assertValue(const T& value)
+    {
+        _fill(_builder, value);
+        auto fact = _builder.assertFact();
+        _env.retainFact(fact);
+        return fact;
+    }
+private:
+    Environment& _env;
+    FactBuilder _builder;
+    KeyOf _keyOf;
+    Fill _fill;
+    std::unordered_map<Key, Entry, Hash> _facts;
+    uint64_t _epoch = 0;
+};
+
+} // namespace Neutron
+#endif // end __LibNeutron_FactMirror_h__
@@ -0,0 +1,226 @@
+/*
+ *
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+#include "OutputRouter.h"
+extern "C" {
+#include "clips.h"
+}
+
+namespace Neutron
+{
+
+std::vector<std::string>
+OutputRouter::standardLogicalNames()
+{
+    return { WPROMPT, WDISPLAY, WDIALOG, WERROR, WWARNING, WTRACE, STDOUT };
+}
+
+OutputRouter::OutputRouter(Environment& env, const std::vector<std::string>& logicalNames, Sink sink, size_t flushThreshold, bool asynchronous, int priority) :
+    _env(env), _sink(std::move(sink)), _flushThreshold(flushThreshold), _asynchronous(asynchronous)
+{
+    if (!_sink) {
+        throw Problem("An output router needs a sink to deliver to!");
+    }
+    for (auto const& name : logicalNames) {
+        _buffers.emplace_back(name, std::string());
+        _buffers.back().second.reserve(flushThreshold);
+    }
+    std::stringstream ss;
+    ss << "neutron-output-" << static_cast<void*>(this);
+    _name = ss.str();
+    if (_asynchronous) {
+        _thread = std::thread(&OutputRouter::backgroundLoop, this);
+    }
+    if (::EnvAddRouterWithContext(_env.getRawEnvironment(), _name.c_str(), priority, query, print, nullptr, nullptr, onExit, this) == FALSE) {
+        if (_asynchronous) {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                _stop = true;
+            }
+            _wakeup.notify_all();
+            _thread.join();
+        }
+        throw Problem("Could not install the output router!");
+    }
+}
+
+OutputRouter::~OutputRouter()
+{
+    ::EnvDeleteRouter(_env.getRawEnvironment(), _name.c_str());
+    auto rest = takeBuffers();
+    if (_asynchronous) {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            if (!rest.empty()) {
+                _pending.emplace_back(std::move(rest));
+            }
+            _stop = true;
+        }
+        _wakeup.notify_all();
+        _thread.join();
+    } else {
+        deliver(rest);
+    }
+}
+
+int
+OutputRouter::query(void* theEnv, const char* logicalName)
+{
+    auto self = static_cast<OutputRouter*>(::GetEnvironmentRouterContext(theEnv));
+    return self->findBuffer(logicalName) == -1 ? FALSE : TRUE;
+}
+
+int
+OutputRouter::print(void* theEnv, const char* logicalName, const char* str)
+{
+    auto self = static_cast<OutputRouter*>(::GetEnvironmentRouterContext(theEnv));
+    auto index = self->findBuffer(logicalName);
+    if (index != -1) {
+        self->append(index, str);
+    }
+    return TRUE;
+}
+
+int
+OutputRouter::onExit(void* theEnv, int)
+{
+    static_cast<OutputRouter*>(::GetEnvironmentRouterContext(theEnv))->flush();
+    return TRUE;
+}
+
+int
+OutputRouter::findBuffer(const char* logicalName) const
+{
+    // only a handful of names are ever captured, a linear scan beats hashing
+    for (size_t i = 0; i < _buffers.size(); ++i) {
+        if (_buffers[i].first == logicalName) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+void
+OutputRouter::append(int index, const char* str)
+{
+    auto len = strlen(str);
+    _buffers[index].second.append(str, len);
+    _buffered += len;
+    if (_buffered < _flushThreshold) {
+        return;
+    }
+    auto batch = takeBuffers();
+    if (_asynchronous) {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _pending.emplace_back(std::move(batch));
+        }
+        _wakeup.notify_one();
+    } else {
+        deliver(batch);
+    }
+}
+
+OutputRouter::Batch
+OutputRouter::takeBuffers()
+{
+    Batch batch;
+    for (auto& buffer : _buffers) {
+        if (!buffer.second.empty()) {
+            batch.emplace_back(buffer.first, std::move(buffer.second));
+            buffer.second.clear();
+            buffer.second.reserve(_flushThreshold);
+        }
+    }
+    std::lock_guard<std::mutex> guard(_lock);
+    _stats.bytesCaptured += _buffered;
+    _buffered = 0;
+    return batch;
+}
+
+void
+OutputRouter::deliver(const Batch& batch)
+{
+    uint64_t delivered = 0;
+    uint64_t failed = 0;
+    for (auto const& entry : batch) {
+        try {
+            _sink(entry.first, entry.second);
+            ++delivered;
+        } catch (...) {
+            // this usually runs inside of a CLIPS print call, which must not be unwound
+            ++failed;
+        }
+    }
+    std::lock_guard<std::mutex> guard(_lock);
+    _stats.batchesDelivered += delivered;
+    _stats.sinkFailures += failed;
+}
+
+void
+OutputRouter::flush()
+{
+    auto batch = takeBuffers();
+    if (!_asynchronous) {
+        deliver(batch);
+        return;
+    }
+    std::unique_lock<std::mutex> guard(_lock);
+    if (!batch.empty()) {
+        _pending.emplace_back(std::move(batch));
+        _wakeup.notify_one();
+    }
+    _drained.wait(guard, [this]() { return _pending.empty() && !_delivering; });
+}
+
+void
+OutputRouter::backgroundLoop()
+{
+    std::unique_lock<std::mutex> guard(_lock);
+    while (true) {
+        _wakeup.wait(guard, [this]() { return _stop || !_pending.empty(); });
+        if (_pending.empty()) {
+            // only stopping gets us here
+            break;
+        }
+        std::vector<Batch> work;
+        work.swap(_pending);
+        _delivering = true;
+        guard.unlock();
+        for (auto const& batch : work) {
+            deliver(batch);
+        }
+        guard.lock();
+        _delivering = false;
+        _drained.notify_all();
+    }
+    _drained.notify_all();
+}
+
+OutputRouterStatistics
+OutputRouter::getStatistics() const
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _stats;
+}
+
+} // namespace Neutron
@@ -0,0 +1,122 @@
+/**
+ * @file
+ * Buffered capture of the text CLIPS prints to its logical names
+ * @copyright
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+#ifndef __LibNeutron_OutputRouter_h__
+#define __LibNeutron_OutputRouter_h__
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Environment.h"
+
+namespace Neutron
+{
+
+/// Counters kept by an OutputRouter
+struct OutputRouterStatistics
+{
+    /// characters printed to the captured logical names
+    uint64_t bytesCaptured = 0;
+    /// batches handed to the sink
+    uint64_t batchesDelivered = 0;
+    /// batches the sink threw on, those are dropped
+    uint64_t sinkFailures = 0;
+};
+
+/**
+ * A CLIPS router which captures everything printed to a set of logical names
+ * (such as watch output on wtrace) into memory and hands it to a sink in large
+ * batches instead of writing it to stdout one line at a time. The sink is
+ * either called from the thread running the environment once enough text has
+ * piled up or, in asynchronous mode, from a background thread so the engine
+ * never waits for the sink.
+ */
+class OutputRouter
+{
+public:
+    /// Receives a batch of text printed to the given logical name
+    using Sink = std::function<void(const std::string& logicalName, const std::string& text)>;
+
+    /// @return the logical names CLIPS prints its regular and trace output to
+    static std::vector<std::string> standardLogicalNames();
+
+    /**
+     * Install the router into the given environment.
+     * @param env the environment to capture the output of, it must outlive the router
+     * @param logicalNames the logical names to capture
+     * @param sink receives the captured text
+     * @param flushThreshold the number of buffered characters which causes a flush
+     * @param asynchronous deliver batches from a background thread
+     * @param priority the CLIPS router priority, higher priorities are asked first
+     * @throw Problem the router could not be installed
+     */
+    OutputRouter(Environment& env, const std::vector<std::string>& logicalNames, Sink sink, size_t flushThreshold = 64 * 1024, bool asynchronous = false, int priority = 40);
+    OutputRouter(const OutputRouter&) = delete;
+    OutputRouter& operator=(const OutputRouter&) = delete;
+    /// Removes the router and delivers whatever is still buffered
+    ~OutputRouter();
+
+    /// Hand everything buffered so far to the sink, in asynchronous mode this
+    /// waits until the background thread has delivered it. Like the
+    /// environment itself this must only be called from the thread using it.
+    void flush();
+
+    OutputRouterStatistics getStatistics() const;
+private:
+    using Batch = std::vector<std::pair<std::string, std::string>>;
+    static int query(void* theEnv, const char* logicalName);
+    static int print(void* theEnv, const char* logicalName, const char* str);
+    static int onExit(void* theEnv, int code);
+    /// @return the index of the buffer for the given logical name or -1
+    int findBuffer(const char* logicalName) const;
+    void append(int index, const char* str);
+    /// move the buffered text into a batch, must be called from the engine thread
+    Batch takeBuffers();
+    void deliver(const Batch& batch);
+    void backgroundLoop();
+private:
+    Environment& _env;
+    std::string _name;
+    Sink _sink;
+    size_t _flushThreshold;
+    bool _asynchronous;
+    /// logical names and the text buffered for them
+    std::vector<std::pair<std::string, std::string>> _buffers;
+    size_t _buffered = 0;
+    mutable std::mutex _lock;
+    std::condition_variable _wakeup;
+    std::condition_variable _drained;
+    std::vector<Batch> _pending;
+    bool _delivering = false;
+    bool _stop = false;
+    OutputRouterStatistics _stats;
+    std::thread _thread;
+};
+
+} // namespace Neutron
+#endif // end __LibNeutron_OutputRouter_h__
@@ -0,0 +1,170 @@
+/*
+ *
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+#include "ShardedEngine.h"
+#include <algorithm>
+
+namespace Neutron
+{
+
+// Begin WorkStealingPool stuff
+WorkStealingPool::WorkStealingPool(size_t threads)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        _workers.emplace_back(new Worker());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        _threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+    }
+    _wakeup.notify_all();
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+}
+
+void
+WorkStealingPool::runAll(std::vector<Task> tasks)
+{
+    if (tasks.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> batch(_batchLock);
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _remaining = tasks.size();
+        _failure = nullptr;
+    }
+    // deal the tasks out round robin, stealing evens out the rest
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        auto& worker = *_workers[i % _workers.size()];
+        std::lock_guard<std::mutex> guard(worker.lock);
+        worker.tasks.emplace_back(std::move(tasks[i]));
+        ++_queued;
+    }
+    std::unique_lock<std::mutex> guard(_lock);
+    _wakeup.notify_all();
+    _finished.wait(guard, [this]() { return _remaining == 0; });
+    if (_failure) {
+        auto failure = _failure;
+        _failure = nullptr;
+        std::rethrow_exception(failure);
+    }
+}
+
+bool
+WorkStealingPool::take(size_t index, Task& task)
+{
+    {
+        auto& own = *_workers[index];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --_queued;
+            return true;
+        }
+    }
+    for (size_t offset = 1; offset < _workers.size(); ++offset) {
+        auto& victim = *_workers[(index + offset) % _workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            // steal from the opposite end the owner works from
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --_queued;
+            ++_steals;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+WorkStealingPool::workerLoop(size_t index)
+{
+    while (true) {
+        Task task;
+        if (take(index, task)) {
+            std::exception_ptr failure;
+            try {
+                task();
+            } catch (...) {
+                failure = std::current_exception();
+            }
+            std::lock_guard<std::mutex> guard(_lock);
+            if (failure && !_failure) {
+                _failure = failure;
+            }
+            if (--_remaining == 0) {
+                _finished.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(_lock);
+        _wakeup.wait(guard, [this]() { return _stop || _queued.load() > 0; });
+        if (_stop) {
+            return;
+        }
+    }
+}
+// end WorkStealingPool stuff
+
+ShardedEngine::ShardedEngine(size_t shards, const std::vector<std::string>& files, Setup setup, size_t threads) : _pool(threads)
+{
+    if (shards == 0) {
+        throw Problem("A sharded engine needs at least one shard!");
+    }
+    for (size_t i = 0; i < shards; ++i) {
+        std::unique_ptr<Environment> env(new Environment());
+        // the constructs in the files may call the functions setup registers
+        if (setup) {
+            setup(*env);
+        }
+        for (auto const& file : files) {
+            env->loadFile(file);
+        }
+        _shards.emplace_back(std::move(env));
+    }
+}
+
+ShardedEngine::ShardedEngine(const BinaryImage& image, size_t shards, Setup setup, size_t threads) : _pool(threads)
+{
+    if (shards == 0) {
+        throw Problem("A sharded engine needs at least one shard!");
+    }
+    for (size_t i = 0; i < shards; ++i) {
+        _shards.emplace_back(new Environment(image, setup));
+    }
+}
+
+} // namespace Neutron
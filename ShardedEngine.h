@@ -0,0 +1,194 @@
+/**
+ * @file
+ * Spreads rule evaluation over several environments and cores
+ * @copyright
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+#ifndef __LibNeutron_ShardedEngine_h__
+#define __LibNeutron_ShardedEngine_h__
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "Environment.h"
+
+namespace Neutron
+{
+
+/**
+ * A fixed set of threads which each keep their own queue of tasks and steal
+ * from the other queues once theirs runs dry, so a few slow tasks do not hold
+ * up the rest of a batch.
+ */
+class WorkStealingPool
+{
+public:
+    using Task = std::function<void()>;
+
+    /// @param threads the number of worker threads, 0 means one per hardware thread
+    explicit WorkStealingPool(size_t threads = 0);
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+    ~WorkStealingPool();
+
+    /**
+     * Run all of the given tasks and wait for them to finish.
+     * @throw the first exception thrown by a task, once every task has finished
+     */
+    void runAll(std::vector<Task> tasks);
+
+    size_t threadCount() const { return _threads.size(); }
+    /// @return how many tasks were taken from another worker's queue so far
+    uint64_t stealCount() const { return _steals.load(); }
+private:
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+    bool take(size_t index, Task& task);
+    void workerLoop(size_t index);
+private:
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::vector<std::thread> _threads;
+    std::mutex _lock;
+    std::condition_variable _wakeup;
+    std::condition_variable _finished;
+    /// tasks which are queued but not yet taken
+    std::atomic<size_t> _queued{0};
+    /// tasks of the current batch which have not finished yet
+    size_t _remaining = 0;
+    std::exception_ptr _failure;
+    bool _stop = false;
+    std::atomic<uint64_t> _steals{0};
+    /// serializes runAll calls
+    std::mutex _batchLock;
+};
+
+/**
+ * Owns a number of environments (shards) loaded with the same constructs and
+ * evaluates a batch of inputs by partitioning it across the shards by key.
+ * Every shard is reset, loaded with its inputs, run and then asked for its
+ * results on a work stealing pool, after which the results are merged. Using
+ * more shards than threads gives the pool room to balance uneven partitions.
+ */
+class ShardedEngine
+{
+public:
+    /// Called once for every shard before its constructs are loaded, this is
+    /// the place to register the user functions the constructs refer to
+    using Setup = std::function<void(Environment&)>;
+
+    /**
+     * @param shards the number of environments to keep
+     * @param files the constructs files to load into every shard
+     * @param setup invoked on every shard before its files are loaded
+     * @param threads the number of worker threads, 0 means one per hardware thread
+     */
+    ShardedEngine(size_t shards, const std::vector<std::string>& files, Setup setup = nullptr, size_t threads = 0);
+
+    /**
+     * Load every shard from the same binary image, which is much faster than
+     * parsing the constructs once per shard.
+     * @param setup invoked on every shard before the image is loaded, see Environment(const BinaryImage&, ...)
+     */
+    ShardedEngine(const BinaryImage& image, size_t shards, Setup setup = nullptr, size_t threads = 0);
+
+    size_t shardCount() const { return _shards.size(); }
+
+    /// Direct access to a shard, only while no evaluation is running
+    Environment& getShard(size_t index) { return *_shards[index]; }
+
+    /// @return the shard the given key is assigned to
+    template<typename Key>
+    size_t shardFor(const Key& key) const { return std::hash<Key>()(key) % _shards.size(); }
+
+    /**
+     * Evaluate the given inputs.
+     * @param keyOf maps an input to the key used to pick its shard, inputs with equal keys share a shard
+     * @param load called as load(Environment&, input) to put an input into working memory
+     * @param extract called as extract(Environment&) after a shard ran to produce its results
+     * @return the result of every shard, in shard order
+     * @throw the first exception thrown on any shard
+     */
+    template<typename I, typename KeyOf, typename Load, typename Extract>
+    std::vector<typename EnvironmentCallResult<Extract>::type> evaluate(I begin, I end, KeyOf keyOf, Load load, Extract extract);
+
+    /// Evaluate the given inputs and fold the results of all shards together
+    /// through merge(accumulated, shardResult)
+    template<typename I, typename KeyOf, typename Load, typename Extract, typename Merge>
+    typename EnvironmentCallResult<Extract>::type evaluate(I begin, I end, KeyOf keyOf, Load load, Extract extract, Merge merge);
+private:
+    std::vector<std::unique_ptr<Environment>> _shards;
+    WorkStealingPool _pool;
+};
+
+template<typename I, typename KeyOf, typename Load, typename Extract>
+std::vector<typename EnvironmentCallResult<Extract>::type>
+ShardedEngine::evaluate(I begin, I end, KeyOf keyOf, Load load, Extract extract)
+{
+    using Input = typename std::iterator_traits<I>::value_type;
+    using Result = typename EnvironmentCallResult<Extract>::type;
+    std::vector<std::vector<const Input*>> partitions(_shards.size());
+    for (I it = begin; it != end; ++it) {
+        partitions[shardFor(keyOf(*it))].emplace_back(&*it);
+    }
+    std::vector<Result> results(_shards.size());
+    std::vector<WorkStealingPool::Task> tasks;
+    tasks.reserve(_shards.size());
+    for (size_t shard = 0; shard < _shards.size(); ++shard) {
+        tasks.emplace_back([this, shard, &partitions, &results, &load, &extract]() {
+                    auto& env = *_shards[shard];
+                    env.reset();
+                    for (auto input : partitions[shard]) {
+                        load(env, *input);
+                    }
+                    env.run();
+                    results[shard] = extract(env);
+                });
+    }
+    _pool.runAll(std::move(tasks));
+    return results;
+}
+
+template<typename I, typename KeyOf, typename Load, typename Extract, typename Merge>
+typename EnvironmentCallResult<Extract>::type
+ShardedEngine::evaluate(I begin, I end, KeyOf keyOf, Load load, Extract extract, Merge merge)
+{
+    auto results = evaluate(begin, end, keyOf, load, extract);
+    auto merged = std::move(results.front());
+    for (size_t i = 1; i < results.size(); ++i) {
+        merge(merged, std::move(results[i]));
+    }
+    return merged;
+}
+
+} // namespace Neutron
+#endif // end __LibNeutron_ShardedEngine_h__
@@ -0,0 +1,148 @@
+/*
+ *
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+// Compares passing large arguments through the forwarding argument pipeline
+// against the by-value pipeline buildAndExecuteFunction used to have. Build
+// with Google Benchmark, for example:
+//
+// g++ --std=c++11 -O2 -I.. -I<path/to/clips/core> ArgumentForwardingBenchmark.cc ../Environment.cc <clips objects> -lbenchmark -lpthread
+
+#include "Environment.h"
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+/// An environment with a deffunction which accepts any number of arguments
+/// and does as little as possible with them
+class ConsumerEnvironment
+{
+public:
+    ConsumerEnvironment()
+    {
+        env.funcall("build", "\"(deffunction consume ($?args) TRUE)\"");
+        consume = env.prepareFunction("consume");
+    }
+    Neutron::Environment env;
+    Neutron::FunctionHandle consume;
+};
+
+// The old pipeline took every argument by value at each level: once in the
+// R& overload, once in the DataObjectPtr overload and once more in
+// FunctionBuilder::addArgument. These helpers reproduce those copies.
+template<typename ... Args>
+void
+copyingAddArgument(Neutron::FunctionBuilder& fb, Args ... args)
+{
+    fb.addArgument(args...);
+}
+
+template<typename ... Args>
+void
+copyingInvoke(Neutron::Environment& env, const Neutron::FunctionHandle& fn, Neutron::DataObjectPtr ret, Args ... args)
+{
+    Neutron::FunctionBuilder fb(&env, fn);
+    copyingAddArgument(fb, args...);
+    fb.invoke(ret);
+}
+
+template<typename R, typename ... Args>
+void
+copyingInvoke(Neutron::Environment& env, const Neutron::FunctionHandle& fn, R& ret, Args ... args)
+{
+    Neutron::DataObject r;
+    copyingInvoke(env, fn, &r, args...);
+    env.extractValue(&r, ret);
+}
+
+std::vector<std::string>
+makeStrings(int64_t count)
+{
+    std::vector<std::string> strings;
+    strings.reserve(count);
+    for (int64_t i = 0; i < count; ++i) {
+        strings.emplace_back("a reasonably long string argument number " + std::to_string(i));
+    }
+    return strings;
+}
+
+void
+BM_VectorArgumentForwarded(benchmark::State& state)
+{
+    ConsumerEnvironment ce;
+    auto strings = makeStrings(state.range(0));
+    bool ret = false;
+    for (auto _ : state) {
+        ce.env.buildAndExecuteFunction(ce.consume, ret, strings, 1);
+        benchmark::DoNotOptimize(ret);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_VectorArgumentForwarded)->Range(16, 4096);
+
+void
+BM_VectorArgumentCopied(benchmark::State& state)
+{
+    ConsumerEnvironment ce;
+    auto strings = makeStrings(state.range(0));
+    bool ret = false;
+    for (auto _ : state) {
+        copyingInvoke(ce.env, ce.consume, ret, strings, 1);
+        benchmark::DoNotOptimize(ret);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_VectorArgumentCopied)->Range(16, 4096);
+
+void
+BM_LongStringArgumentForwarded(benchmark::State& state)
+{
+    ConsumerEnvironment ce;
+    std::string str(state.range(0), 'x');
+    bool ret = false;
+    for (auto _ : state) {
+        ce.env.buildAndExecuteFunction(ce.consume, ret, str, str, str);
+        benchmark::DoNotOptimize(ret);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * 3);
+}
+BENCHMARK(BM_LongStringArgumentForwarded)->Range(64, 1 << 16);
+
+void
+BM_LongStringArgumentCopied(benchmark::State& state)
+{
+    ConsumerEnvironment ce;
+    std::string str(state.range(0), 'x');
+    bool ret = false;
+    for (auto _ : state) {
+        copyingInvoke(ce.env, ce.consume, ret, str, str, str);
+        benchmark::DoNotOptimize(ret);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * 3);
+}
+BENCHMARK(BM_LongStringArgumentCopied)->Range(64, 1 << 16);
+
+} // end namespace
+
+BENCHMARK_MAIN();
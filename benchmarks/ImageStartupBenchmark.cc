@@ -0,0 +1,91 @@
+/*
+ *
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+// Compares bringing up an environment by parsing a constructs file against
+// loading the same constructs from a binary image. Build with Google
+// Benchmark, for example:
+//
+// g++ --std=c++11 -O2 -I.. -I<path/to/clips/core> ImageStartupBenchmark.cc ../Environment.cc <clips objects> -lbenchmark -lpthread
+
+#include "Environment.h"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+namespace
+{
+
+const char* sourcePath = "neutron-startup-benchmark.clp";
+const char* imagePath = "neutron-startup-benchmark.bin";
+
+/// Write a constructs file with the given number of templates and rules and
+/// the matching binary image
+void
+writeRuleBase(int64_t rules)
+{
+    {
+        std::ofstream out(sourcePath);
+        for (int64_t i = 0; i < rules; ++i) {
+            out << "(deftemplate order" << i << " (slot id) (slot price (type FLOAT)) (multislot items))" << std::endl;
+            out << "(defrule discount" << i << std::endl
+                << "    ?o <- (order" << i << " (id ?id) (price ?p&:(> ?p 100.0)) (items $? widget $?))" << std::endl
+                << "    =>" << std::endl
+                << "    (modify ?o (price (* ?p 0.9))))" << std::endl;
+        }
+    }
+    Neutron::Environment env;
+    env.loadFile(sourcePath);
+    env.saveImage(imagePath);
+}
+
+void
+BM_StartupFromSource(benchmark::State& state)
+{
+    writeRuleBase(state.range(0));
+    for (auto _ : state) {
+        Neutron::Environment env;
+        env.loadFile(sourcePath);
+        benchmark::DoNotOptimize(env.getRawEnvironment());
+    }
+    std::remove(sourcePath);
+    std::remove(imagePath);
+}
+BENCHMARK(BM_StartupFromSource)->Range(16, 1024)->Unit(benchmark::kMillisecond);
+
+void
+BM_StartupFromImage(benchmark::State& state)
+{
+    writeRuleBase(state.range(0));
+    Neutron::BinaryImage image(imagePath);
+    for (auto _ : state) {
+        Neutron::Environment env(image);
+        benchmark::DoNotOptimize(env.getRawEnvironment());
+    }
+    std::remove(sourcePath);
+    std::remove(imagePath);
+}
+BENCHMARK(BM_StartupFromImage)->Range(16, 1024)->Unit(benchmark::kMillisecond);
+
+} // end namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,477 @@
+/*
+ *
+ * Copyright (c) 2015-2016 Parasoft Corporation
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ */
+
+// Covers the hot paths of the wrapper: calling functions, tagging arguments,
+// extracting results, building multifields, creating and accessing instances,
+// looking up external address types and resetting compared to restoring a
+// snapshot. Built by the CMake project in this directory, see
+// benchmarks/CMakeLists.txt.
+
+#include "Environment.h"
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+const char* constructs =
+    "(deffunction consume ($?args) TRUE)\n"
+    "(deffunction echo (?x) ?x)\n"
+    "(defclass point (is-a USER) (slot x) (slot y) (slot label))\n";
+
+NEUTRON_DECLARE_FUNCTION(Consume, "consume");
+
+struct Order
+{
+    int64_t id;
+};
+
+Neutron::Environment::ExternalAddressType orderType = { "order", nullptr, nullptr, nullptr, nullptr, nullptr };
+
+/// An environment with the constructs above loaded and the handles the
+/// benchmarks need resolved once
+class WrapperEnvironment
+{
+public:
+    WrapperEnvironment()
+    {
+        env.loadFromBuffer(constructs, std::strlen(constructs));
+        consume = env.prepareFunction("consume");
+        echo = env.prepareFunction("echo");
+        point = env.findDefclass("point");
+        x = env.findSlot(point, "x");
+        label = env.findSlot(point, "label");
+        env.registerExternalAddressType<Order>(&orderType);
+    }
+    /// Values which are never installed pile up in the ephemeral lists until
+    /// CLIPS gets to collect them, so benchmarks producing such values call
+    /// this once per iteration to compact outside of the timed region every
+    /// so often and keep measuring the same heap
+    void reclaim(benchmark::State& state)
+    {
+        if (++produced % reclaimInterval == 0) {
+            state.PauseTiming();
+            env.compact();
+            state.ResumeTiming();
+        }
+    }
+    static constexpr size_t reclaimInterval = 1024;
+    size_t produced = 0;
+    Neutron::Environment env;
+    Neutron::FunctionHandle consume;
+    Neutron::FunctionHandle echo;
+    Neutron::DefclassHandle point;
+    Neutron::SlotHandle x;
+    Neutron::SlotHandle label;
+};
+
+// Begin function call stuff
+void
+BM_FuncallStringArguments(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    Neutron::DataObject ret;
+    for (auto _ : state) {
+        we.env.funcall("consume", "1 2.5 \"three\" four", &ret);
+        benchmark::DoNotOptimize(ret.value);
+    }
+}
+BENCHMARK(BM_FuncallStringArguments);
+
+void
+BM_BuildAndExecuteByName(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    bool ret = false;
+    for (auto _ : state) {
+        we.env.buildAndExecuteFunction("consume", ret, 1, 2.5, "three", Neutron::FunctionBuilder::symbol("four"));
+        benchmark::DoNotOptimize(ret);
+    }
+}
+BENCHMARK(BM_BuildAndExecuteByName);
+
+void
+BM_BuildAndExecuteByHandle(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    bool ret = false;
+    for (auto _ : state) {
+        we.env.buildAndExecuteFunction(we.consume, ret, 1, 2.5, "three", Neutron::FunctionBuilder::symbol("four"));
+        benchmark::DoNotOptimize(ret);
+    }
+}
+BENCHMARK(BM_BuildAndExecuteByHandle);
+
+void
+BM_RewoundFunctionBuilder(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    Neutron::FunctionBuilder fb(&we.env, we.consume);
+    Neutron::DataObject ret;
+    for (auto _ : state) {
+        fb.rewind();
+        fb.addArgument(1, 2.5, "three", Neutron::FunctionBuilder::symbol("four"));
+        fb.invoke(&ret);
+        benchmark::DoNotOptimize(ret.value);
+    }
+}
+BENCHMARK(BM_RewoundFunctionBuilder);
+
+void
+BM_DeclaredFunctionCall(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    bool ret = false;
+    for (auto _ : state) {
+        we.env.call<Consume>(ret, 1, 2.5, "three", Neutron::FunctionBuilder::symbol("four"));
+        benchmark::DoNotOptimize(ret);
+    }
+}
+BENCHMARK(BM_DeclaredFunctionCall);
+
+void
+BM_StringArgument(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    std::string value("widget");
+    std::string ret;
+    for (auto _ : state) {
+        we.env.buildAndExecuteFunction(we.echo, ret, value);
+        benchmark::DoNotOptimize(ret.data());
+    }
+}
+BENCHMARK(BM_StringArgument);
+
+void
+BM_SymbolArgument(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    std::string value("widget");
+    std::string ret;
+    for (auto _ : state) {
+        we.env.buildAndExecuteFunction(we.echo, ret, Neutron::FunctionBuilder::symbol(value));
+        benchmark::DoNotOptimize(ret.data());
+    }
+}
+BENCHMARK(BM_SymbolArgument);
+
+void
+BM_CachedSymbolArgument(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    we.env.enableSymbolCache();
+    std::string value("widget");
+    std::string ret;
+    for (auto _ : state) {
+        we.env.buildAndExecuteFunction(we.echo, ret, Neutron::FunctionBuilder::symbol(value));
+        benchmark::DoNotOptimize(ret.data());
+    }
+}
+BENCHMARK(BM_CachedSymbolArgument);
+// end function call stuff
+
+// Begin extraction stuff
+void
+BM_ExtractString(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    Neutron::DataObject value;
+    Neutron::injectData(&we.env, &value, std::string("a reasonably long string value"));
+    for (auto _ : state) {
+        std::string result;
+        we.env.extractValue(&value, result);
+        benchmark::DoNotOptimize(result.data());
+    }
+}
+BENCHMARK(BM_ExtractString);
+
+void
+BM_ExtractInteger(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    Neutron::DataObject value;
+    Neutron::injectData(&we.env, &value, int64_t(42));
+    for (auto _ : state) {
+        int64_t result = 0;
+        we.env.extractValue(&value, result);
+        benchmark::DoNotOptimize(result);
+    }
+}
+BENCHMARK(BM_ExtractInteger);
+
+std::vector<std::string>
+makeStrings(int64_t count)
+{
+    std::vector<std::string> strings;
+    strings.reserve(count);
+    for (int64_t i = 0; i < count; ++i) {
+        strings.emplace_back("item" + std::to_string(i));
+    }
+    return strings;
+}
+
+void
+BM_ExtractMultifieldStrings(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    auto value = Neutron::MultifieldBuilder::makeDataObject(&we.env, makeStrings(state.range(0)));
+    for (auto _ : state) {
+        std::vector<std::string> result;
+        we.env.extractValue(&value, result);
+        benchmark::DoNotOptimize(result.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ExtractMultifieldStrings)->Range(8, 4096);
+
+void
+BM_ExtractMultifieldView(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    auto value = Neutron::MultifieldBuilder::makeDataObject(&we.env, makeStrings(state.range(0)));
+    for (auto _ : state) {
+        Neutron::MultifieldView result;
+        we.env.extractValue(&value, result);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ExtractMultifieldView)->Range(8, 4096);
+
+void
+BM_ExtractMultifieldIntegers(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    std::vector<int64_t> numbers(state.range(0), 7);
+    auto value = Neutron::MultifieldBuilder::makeDataObject(&we.env, numbers);
+    for (auto _ : state) {
+        std::vector<int64_t> result;
+        we.env.extractValue(&value, result);
+        benchmark::DoNotOptimize(result.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ExtractMultifieldIntegers)->Range(8, 4096);
+// end extraction stuff
+
+// Begin multifield stuff
+void
+BM_MultifieldBuilderIntegers(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    std::vector<int64_t> numbers(state.range(0), 7);
+    for (auto _ : state) {
+        auto value = Neutron::MultifieldBuilder::makeDataObject(&we.env, numbers);
+        benchmark::DoNotOptimize(value.value);
+        we.reclaim(state);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MultifieldBuilderIntegers)->Range(8, 4096);
+
+void
+BM_MultifieldBuilderStrings(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    auto strings = makeStrings(state.range(0));
+    for (auto _ : state) {
+        auto value = Neutron::MultifieldBuilder::makeDataObject(&we.env, strings);
+        benchmark::DoNotOptimize(value.value);
+        we.reclaim(state);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MultifieldBuilderStrings)->Range(8, 4096);
+// end multifield stuff
+
+// Begin instance stuff
+void
+BM_MakeInstanceFromString(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    for (auto _ : state) {
+        // reusing the name deletes the previous instance so memory stays flat
+        auto instance = we.env.makeInstance("(bench-point of point (x 1) (y 2) (label origin))");
+        benchmark::DoNotOptimize(instance);
+    }
+}
+BENCHMARK(BM_MakeInstanceFromString);
+
+void
+BM_MakeInstanceWithBuilder(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    auto y = we.env.findSlot(we.point, "y");
+    Neutron::InstanceBuilder ib(&we.env, we.point);
+    for (auto _ : state) {
+        ib.setName("bench-point").set(we.x, int64_t(1)).set(y, int64_t(2)).set(we.label, Neutron::FunctionBuilder::symbol("origin"));
+        benchmark::DoNotOptimize(ib.makeInstance());
+    }
+}
+BENCHMARK(BM_MakeInstanceWithBuilder);
+
+void
+BM_SetSlotByName(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    auto instance = we.env.makeInstance("(bench-point of point)");
+    Neutron::DataObject value;
+    Neutron::injectData(&we.env, &value, int64_t(42));
+    for (auto _ : state) {
+        we.env.setSlot(instance, "x", &value);
+    }
+}
+BENCHMARK(BM_SetSlotByName);
+
+void
+BM_SetSlotByHandle(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    auto instance = we.env.makeInstance("(bench-point of point)");
+    Neutron::DataObject value;
+    Neutron::injectData(&we.env, &value, int64_t(42));
+    for (auto _ : state) {
+        we.env.setSlot(instance, we.x, &value);
+    }
+}
+BENCHMARK(BM_SetSlotByHandle);
+
+void
+BM_GetSlotByName(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    auto instance = we.env.makeInstance("(bench-point of point (x 42))");
+    Neutron::DataObject ret;
+    for (auto _ : state) {
+        we.env.getSlot(instance, "x", &ret);
+        benchmark::DoNotOptimize(ret.value);
+    }
+}
+BENCHMARK(BM_GetSlotByName);
+
+void
+BM_GetSlotByHandle(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    auto instance = we.env.makeInstance("(bench-point of point (x 42))");
+    Neutron::DataObject ret;
+    for (auto _ : state) {
+        we.env.getSlot(instance, we.x, &ret);
+        benchmark::DoNotOptimize(ret.value);
+    }
+}
+BENCHMARK(BM_GetSlotByHandle);
+// end instance stuff
+
+// Begin external address stuff
+void
+BM_ExternalAddressIdLookup(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Neutron::ExternalAddressCache<Order>::getExternalAddressId(&we.env));
+    }
+}
+BENCHMARK(BM_ExternalAddressIdLookup);
+
+void
+BM_AddExternalAddress(benchmark::State& state)
+{
+    WrapperEnvironment we;
+    Order order { 1 };
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(we.env.addExternalAddress(&order));
+        we.reclaim(state);
+    }
+}
+BENCHMARK(BM_AddExternalAddress);
+// end external address stuff
+
+// Begin reset stuff
+/// An environment whose reset asserts the given number of facts and makes a
+/// few instances, each request retracts one of the facts and asserts another
+class ResetEnvironment
+{
+public:
+    explicit ResetEnvironment(int64_t facts)
+    {
+        std::string source = "(deftemplate item (slot id) (slot price))\n(deffacts items\n";
+        for (int64_t i = 0; i < facts; ++i) {
+            source += "    (item (id " + std::to_string(i) + ") (price " + std::to_string(i * 3) + "))\n";
+        }
+        source += ")\n(defclass point (is-a USER) (slot x))\n(definstances points (p1 of point (x 1)) (p2 of point (x 2)))\n";
+        source += "(defrule expensive (item (id ?id) (price ?p&:(> ?p 100))) => )\n";
+        env.loadFromBuffer(source.data(), source.size());
+        item = env.findDeftemplate("item");
+        id = env.findFactSlot(item, "id");
+        price = env.findFactSlot(item, "price");
+        env.reset();
+    }
+
+    void request()
+    {
+        for (auto const& row : env.facts(item)) {
+            env.retractFact(row.address);
+            break;
+        }
+        Neutron::FactBuilder fb(&env, item);
+        fb.set(id, int64_t(-1)).set(price, int64_t(1000)).assertFact();
+        env.run();
+    }
+
+    Neutron::Environment env;
+    Neutron::DeftemplateHandle item;
+    Neutron::FactSlotHandle id;
+    Neutron::FactSlotHandle price;
+};
+
+void
+BM_ResetAfterRequest(benchmark::State& state)
+{
+    ResetEnvironment re(state.range(0));
+    for (auto _ : state) {
+        re.request();
+        re.env.reset();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ResetAfterRequest)->Range(16, 4096)->Unit(benchmark::kMicrosecond);
+
+void
+BM_RestoreAfterRequest(benchmark::State& state)
+{
+    ResetEnvironment re(state.range(0));
+    auto snapshot = re.env.snapshot();
+    for (auto _ : state) {
+        re.request();
+        re.env.restore(snapshot);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RestoreAfterRequest)->Range(16, 4096)->Unit(benchmark::kMicrosecond);
+// end reset stuff
+
+} // end namespace
+
+BENCHMARK_MAIN();